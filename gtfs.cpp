@@ -4,47 +4,2394 @@
 	if (verbose) cout << "VERBOSE: "<< __FILE__ << ":" << __LINE__ << ":" << __func__ << "():" << str; \
 	} while(0)
 
+#define COMMIT_REQ_IOVCNT 3 // record header, filename, data
+
+#define LOG_MAGIC 0x474c5447 // "GTLG"
+#define LOG_FORMAT_VERSION 3
+#define LOG_RECORD_MAGIC 0x43455247 // "GREC"
+#define LOG_WRITE 1 // a record carrying data written to a file
+#define LOG_PAD 2 // no file: covers the log region of an appender that died
+#define LOG_TXN 3 // ranges of one or more files, written by one transaction
+#define LOG_DROP 4 // tombstone: the file was removed, its earlier records are void
+#define LOG_ZWRITE 5 // a LOG_WRITE whose data is compressed (see lz_compress())
+
+#define IDX_MAGIC 0x58444947 // "GIDX"
+#define IDX_EXTENT 1 // a valid log record of a file
+#define IDX_DROP 2 // the file was removed, forget its records before log_end
+#define IDX_MARK 3 // no file: the log up to log_end has been indexed
+#define IDX_TXN_EXTENT 4 // a valid range inside a transaction record
+#define IDX_ZEXTENT 5 // a valid compressed record of a file; length is the uncompressed one
+#define IDX_VOID 6 // no file: [log_offset, log_end) was padded, forget the records indexed in it
+
+#define CRC32C_INIT 0xFFFFFFFF
+
+#define LZ_HASH_BITS 12 // the compressor remembers 1 << LZ_HASH_BITS earlier positions
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+#define SHARED_MAGIC 0x33534754 // "GTS3": a control block of log format version 3
+#define APPEND_GATE_MAX 16384 // value of the append gate when nobody holds it
+#define APPEND_RESCUE_CHECK_US 10000 // how long an appender waits before looking for a dead one
+
+#define FILE_CACHE_MAGIC 0x33465447 // "GTF3"
+#define FILE_CACHE_PROJ 3 // ftok() id of a file's cache segment; the directory uses 1 and 2
+
 int do_verbose;
-static struct sembuf op1, op2;
 
-static void define_sem_op(struct sembuf* op1, struct sembuf* op2) {
-	op1->sem_num = 0;
-	op1->sem_op = -1;
-	op1->sem_flg = 0;
-	op2->sem_num = 0;
-	op2->sem_op = 1;
-	op2->sem_flg = 0;
+// a shard of the counters of gtfs_t; the padding keeps shards of different
+// threads off each other's cache lines
+struct gtfs_stats_shard {
+	gtfs_stats_t s;
+	char pad[64];
+};
+
+static const char* stats_op_names[GTFS_OP_COUNT] = { "open", "read", "write", "sync", "abort", "remove", "clean" };
+
+static uint64_t stats_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the calling thread's shard, picked round robin on its first use
+static gtfs_stats_t& stats_shard(gtfs_t* gtfs) {
+	static int next_shard = 0;
+	static __thread int shard = -1;
+	if (shard == -1) shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % GTFS_STATS_SHARDS;
+	return gtfs->stats[shard].s;
+}
+
+static void stats_add(uint64_t& counter, uint64_t n) {
+	__atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+}
+
+// count an operation that started at stats_now() == start
+static void stats_op(gtfs_t* gtfs, int op, uint64_t start) {
+	uint64_t ns = stats_now() - start;
+	gtfs_op_stats_t& o = stats_shard(gtfs).ops[op];
+	int bucket = 0;
+	for (uint64_t us = ns / 1000; us > 0 && bucket < GTFS_STATS_BUCKETS - 1; us >>= 1) bucket++;
+	stats_add(o.count, 1);
+	stats_add(o.total_ns, ns);
+	stats_add(o.buckets[bucket], 1);
+	uint64_t max = __atomic_load_n(&o.max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&o.max_ns, &max, ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// count a wait for the directory lock or the append gate
+static void stats_wait(gtfs_t* gtfs, uint64_t start) {
+	gtfs_stats_t& st = stats_shard(gtfs);
+	stats_add(st.lock_waits, 1);
+	stats_add(st.lock_wait_ns, stats_now() - start);
+}
+
+// Directory lock. Threads of one process serialize on an in-process mutex;
+// the SysV semaphore is only needed against other processes, so while local
+// threads are waiting the holder hands the directory over without releasing
+// the semaphore (up to DIR_LOCK_MAX_HANDOFFS times in a row, so that other
+// processes are not starved). SEM_UNDO releases it if the process dies.
+static void dir_sem_op(int sem_id, short op) {
+	struct sembuf sop;
+	sop.sem_num = 0;
+	sop.sem_op = op;
+	sop.sem_flg = SEM_UNDO;
+	while (semop(sem_id, &sop, 1) == -1) {
+		if (errno != EINTR) {
+			perror("In dir_sem_op()");
+			break;
+		}
+	}
+}
+
+static void dir_lock(gtfs_t* gtfs) {
+	uint64_t start = stats_now();
+	pthread_mutex_lock(&gtfs->dir_mutex);
+	gtfs->dir_waiters++;
+	while (gtfs->dir_owned) pthread_cond_wait(&gtfs->dir_cond, &gtfs->dir_mutex);
+	gtfs->dir_waiters--;
+	gtfs->dir_owned = true;
+	bool need_sem = !gtfs->dir_sem_held;
+	pthread_mutex_unlock(&gtfs->dir_mutex);
+	if (need_sem) {
+		dir_sem_op(gtfs->sem_id, -1);
+		gtfs->dir_sem_held = true;
+	}
+	stats_wait(gtfs, start);
+}
+
+static void dir_unlock(gtfs_t* gtfs) {
+	pthread_mutex_lock(&gtfs->dir_mutex);
+	if (gtfs->dir_waiters > 0 && gtfs->dir_handoffs < DIR_LOCK_MAX_HANDOFFS) {
+		gtfs->dir_handoffs++;
+	} else {
+		dir_sem_op(gtfs->sem_id, 1);
+		gtfs->dir_sem_held = false;
+		gtfs->dir_handoffs = 0;
+	}
+	gtfs->dir_owned = false;
+	pthread_cond_signal(&gtfs->dir_cond);
+	pthread_mutex_unlock(&gtfs->dir_mutex);
+}
+
+// CRC32C (Castagnoli), with the SSE4.2 crc32 instruction when the CPU has it
+struct crc32c_table {
+	uint32_t entries[256];
+	crc32c_table() {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+			entries[i] = c;
+		}
+	}
+};
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* p, size_t len) {
+	// built on first use; syncers and recovery workers may get here at once,
+	// and a local static is initialised exactly once before any of them reads it
+	static const crc32c_table table;
+	while (len--) crc = table.entries[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+#if GTFS_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* p, size_t len) {
+	uint64_t c = crc;
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c = _mm_crc32_u64(c, v);
+		p += 8;
+		len -= 8;
+	}
+	uint32_t c32 = (uint32_t) c;
+	while (len--) c32 = _mm_crc32_u8(c32, *p++);
+	return c32;
+}
+
+static bool crc32c_use_hw = __builtin_cpu_supports("sse4.2");
+#endif
+
+// continue a CRC32C over buf; start from CRC32C_INIT and invert the result
+static uint32_t crc32c_update(uint32_t crc, const void* buf, size_t len) {
+#if GTFS_HAVE_SSE42
+	if (crc32c_use_hw) return crc32c_hw(crc, (const unsigned char*) buf, len);
+#endif
+	return crc32c_sw(crc, (const unsigned char*) buf, len);
+}
+
+// Log record compression, an LZ77 codec in the style of LZ4 block format.
+// The compressed data is a sequence of tokens, each one a byte with the
+// number of literals in its high nibble and the match length minus
+// LZ_MIN_MATCH in its low one (15 meaning more length bytes follow, each
+// added, until one is below 255), then the literals, then the 2-byte offset of
+// the match back from the current position. The data ends after the literals
+// of a token once the uncompressed length is reached.
+
+// append one token to out at o; returns the new end of out, or -1 if it would
+// go past cap
+static int lz_emit(unsigned char* out, int o, int cap, const unsigned char* lit, int nlit, int offset, int mlen) {
+	if (o + 1 + nlit + nlit / 255 + 1 + 2 + mlen / 255 + 1 > cap) return -1;
+	int mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+	out[o++] = (min(nlit, 15) << 4) | min(mcode, 15);
+	if (nlit >= 15) {
+		int rest = nlit - 15;
+		for (; rest >= 255; rest -= 255) out[o++] = 255;
+		out[o++] = rest;
+	}
+	memcpy(out + o, lit, nlit);
+	o += nlit;
+	if (mlen == 0) return o;
+	out[o++] = offset & 0xFF;
+	out[o++] = offset >> 8;
+	if (mcode >= 15) {
+		int rest = mcode - 15;
+		for (; rest >= 255; rest -= 255) out[o++] = 255;
+		out[o++] = rest;
+	}
+	return o;
+}
+
+// compress n bytes of src into dst; returns the compressed length, or -1 if
+// it does not fit in cap bytes
+static int lz_compress(const char* src, int n, char* dst, int cap) {
+	const unsigned char* in = (const unsigned char*) src;
+	unsigned char* out = (unsigned char*) dst;
+	int table[1 << LZ_HASH_BITS];
+	memset(table, -1, sizeof(table));
+	int anchor = 0, o = 0;
+	for (int i = 0; i + LZ_MIN_MATCH <= n;) {
+		uint32_t v;
+		memcpy(&v, in + i, sizeof(v));
+		uint32_t h = (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+		int cand = table[h];
+		table[h] = i;
+		if (cand < 0 || i - cand > LZ_MAX_OFFSET || memcmp(in + cand, in + i, LZ_MIN_MATCH) != 0) {
+			i++;
+			continue;
+		}
+		int mlen = LZ_MIN_MATCH;
+		while (i + mlen < n && in[cand + mlen] == in[i + mlen]) mlen++;
+		o = lz_emit(out, o, cap, in + anchor, i - anchor, i - cand, mlen);
+		if (o == -1) return -1;
+		i += mlen;
+		anchor = i;
+	}
+	if (anchor < n) o = lz_emit(out, o, cap, in + anchor, n - anchor, 0, 0);
+	return o;
+}
+
+// decompress n bytes of src into the length bytes of dst; returns 0, or -1 if
+// src is not the compressed form of exactly length bytes
+static int lz_decompress(const char* src, int n, char* dst, int length) {
+	const unsigned char* in = (const unsigned char*) src;
+	unsigned char* out = (unsigned char*) dst;
+	int ip = 0, op = 0;
+	while (op < length) {
+		if (ip >= n) return -1;
+		int token = in[ip++];
+		int nlit = token >> 4;
+		if (nlit == 15) {
+			int b;
+			do {
+				if (ip >= n) return -1;
+				b = in[ip++];
+				nlit += b;
+			} while (b == 255);
+		}
+		if (nlit > n - ip || nlit > length - op) return -1;
+		memcpy(out + op, in + ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (op == length) break;
+		if (ip + 2 > n) return -1;
+		int offset = in[ip] | (in[ip + 1] << 8);
+		ip += 2;
+		int mlen = token & 15;
+		if (mlen == 15) {
+			int b;
+			do {
+				if (ip >= n) return -1;
+				b = in[ip++];
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op || mlen > length - op) return -1;
+		// byte by byte: the match may overlap what it produces
+		for (int k = 0; k < mlen; k++, op++) out[op] = out[op - offset];
+	}
+	return ip == n ? 0 : -1;
+}
+
+// on-disk layout of the log: <dir>/log only holds a log_header (the
+// manifest), the records live in segment files <dir>/log.<n>, segment n
+// holding log positions [n * segment_size, (n + 1) * segment_size). Log
+// positions only grow, and a record may continue in the next segment. Each
+// record is a log_record_header, the filename and the data.
+struct log_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t base; // everything before this log position is checkpointed into the files
+	uint64_t segment_size;
+};
+
+// format version 1 kept the records in <dir>/log itself, after this header
+struct log_header_v1 {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t start_lsn; // lsn of file offset 0
+};
+
+struct log_record_header {
+	uint32_t magic;
+	uint32_t crc; // CRC32C of filename and data, then of this header with crc and valid zeroed
+	uint64_t lsn; // position of the record in the log
+	int64_t offset;
+	int64_t length;
+	int32_t filename_length;
+	uint8_t type;
+	uint8_t valid; // not covered by crc: older versions cleared it to remove a file
+	uint16_t reserved;
+};
+
+// the data of a LOG_ZWRITE record is a uint64_t with its uncompressed length,
+// then the compressed bytes; its length is that of both
+// a LOG_TXN record has no filename; offset is the number of ranges and length
+// the size of the ranges, each one a txn_range_header, the filename and the data
+struct txn_range_header {
+	int64_t offset;
+	int64_t length;
+	int32_t filename_length;
+	uint8_t valid; // not covered by crc, like log_record_header::valid
+	uint8_t reserved[3];
+};
+
+// the records of format versions 1 and 2 had 32-bit offsets and lengths (and
+// a uint32_t uncompressed length in LOG_ZWRITE)
+struct log_record_header_v2 {
+	uint32_t magic;
+	uint32_t crc;
+	uint64_t lsn;
+	int32_t filename_length;
+	int32_t offset;
+	int32_t length;
+	uint8_t type;
+	uint8_t valid;
+	uint16_t reserved;
+};
+
+struct txn_range_header_v2 {
+	int32_t filename_length;
+	int32_t offset;
+	int32_t length;
+	uint8_t valid;
+	uint8_t reserved[3];
+};
+
+// finish the crc of a record whose filename and data checksum to payload_crc
+static uint32_t log_record_crc(const log_record_header& rh, uint32_t payload_crc) {
+	log_record_header h = rh;
+	h.crc = 0;
+	h.valid = 0;
+	return ~crc32c_update(payload_crc, &h, sizeof(h));
+}
+
+// Shared control block, kept in the directory's shm segment. Appenders of
+// every process reserve a region of the log with a fetch-add on log_tail and
+// fill it with pwritev() in parallel, holding the append gate only shared.
+// Regions are published (indexed and acknowledged) in log order, so readers
+// never see a hole below published. If an appender dies in between, the one
+// waiting behind it covers its region with a LOG_PAD record.
+struct shared_slot {
+	pid_t pid; // 0 if free
+	int reserved; // start and length describe the slot's region
+	uint64_t start;
+	uint64_t length;
+};
+
+struct shared_file {
+	char filename[MAX_FILENAME_LEN + 1]; // empty if the entry is free
+	int open_count; // open file_t handles, in every process
+	int record_count; // log records of the file since the last checkpoint
+};
+
+struct gtfs_shared {
+	uint32_t magic; // SHARED_MAGIC once the block was rebuilt from the log
+	dev_t log_dev; // the segment outlives the directory: check it is the same log
+	ino_t log_ino;
+	uint64_t base; // base of the log header
+	uint64_t segment_size;
+	uint64_t epoch; // changes whenever the block is rebuilt: log positions may be reused then
+	uint64_t log_tail; // end of the reserved part of the log
+	uint64_t published; // end of the written and indexed part of the log
+	pid_t rescuer; // process covering the region of a dead appender
+	uint64_t hole_end; // the region from published to here could not be padded, nothing is published past it (0: none)
+	shared_slot slots[SHARED_MAX_APPENDERS];
+	shared_file files[MAX_NUM_FILES_PER_DIR];
+};
+
+static void fsync_dir(const string& dirname) {
+	int dir_fd = open(dirname.c_str(), O_RDONLY);
+	if (dir_fd == -1) return;
+	fsync(dir_fd);
+	close(dir_fd);
+}
+
+// read length bytes at offset, with as many pread() calls as it takes: one
+// call reads at most about 2GB. Returns the number of bytes read, less than
+// length only at the end of the file, or -1.
+static ssize_t pread_full(int fd, char* buf, off_t length, off_t offset) {
+	off_t done = 0;
+	while (done < length) {
+		ssize_t nr = pread(fd, buf + done, length - done, offset + done);
+		if (nr == -1 && errno == EINTR) continue;
+		if (nr == -1) return -1;
+		if (nr == 0) break;
+		done += nr;
+	}
+	return done;
+}
+
+// write iov at offset with as few pwritev() calls as possible
+static int pwritev_full(int fd, vector<struct iovec>& iov, off_t offset) {
+	size_t idx = 0;
+	while (idx < iov.size()) {
+		int cnt = iov.size() - idx;
+		if (cnt > IOV_MAX) cnt = IOV_MAX;
+		ssize_t nw = pwritev(fd, &iov[idx], cnt, offset);
+		if (nw == -1) {
+			if (errno == EINTR) continue;
+			perror("In pwritev_full()");
+			return -1;
+		}
+		offset += nw;
+		// also steps over empty entries, which pwritev() leaves behind
+		while (idx < iov.size() && (size_t) nw >= iov[idx].iov_len) {
+			nw -= iov[idx].iov_len;
+			idx++;
+		}
+		if (nw > 0) {
+			iov[idx].iov_base = (char*) iov[idx].iov_base + nw;
+			iov[idx].iov_len -= nw;
+		}
+	}
+	iov.clear();
+	return 0;
+}
+
+// a loop whose iterations run on a few threads, each taking the next one
+struct parallel_loop {
+	void (*body)(void* arg, int worker, size_t i);
+	void* arg;
+	size_t n;
+	size_t next;
+	int workers;
+};
+
+static void parallel_run(parallel_loop* loop, int worker) {
+	for (;;) {
+		size_t i = __atomic_fetch_add(&loop->next, 1, __ATOMIC_SEQ_CST);
+		if (i >= loop->n) break;
+		loop->body(loop->arg, worker, i);
+	}
+}
+
+static void* parallel_thread(void* arg) {
+	parallel_loop* loop = (parallel_loop*) arg;
+	parallel_run(loop, __atomic_fetch_add(&loop->workers, 1, __ATOMIC_SEQ_CST));
+	return NULL;
+}
+
+// run body(arg, worker, i) for every i in [0, n) on up to threads threads,
+// the caller being worker 0, and wait for them all; the other workers are
+// numbered from 1 (and below threads)
+static void parallel_for(int threads, size_t n, void (*body)(void* arg, int worker, size_t i), void* arg) {
+	parallel_loop loop = { body, arg, n, 0, 1 };
+	vector<pthread_t> tids;
+	for (int t = 1; t < threads && (size_t) t < n; t++) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, parallel_thread, &loop) == 0) tids.push_back(tid);
+	}
+	parallel_run(&loop, 0);
+	for (size_t t = 0; t < tids.size(); t++) pthread_join(tids[t], NULL);
+}
+
+static string segment_path(gtfs_t* gtfs, uint64_t seg) {
+	char name[32];
+	snprintf(name, sizeof(name), "/log.%08llx", (unsigned long long) seg);
+	return gtfs->dirname + name;
+}
+
+// the file descriptor of a log segment, opened (or created) on first use
+static int segment_fd(gtfs_t* gtfs, uint64_t seg, bool create) {
+	pthread_mutex_lock(&gtfs->segment_lock);
+	map<uint64_t, int>::iterator it = gtfs->segment_fds.find(seg);
+	int fd = it == gtfs->segment_fds.end() ? -1 : it->second;
+	if (fd == -1) {
+		string path = segment_path(gtfs, seg);
+		fd = open(path.c_str(), O_RDWR);
+		if (fd == -1 && create) {
+			fd = open(path.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+			// the segment must still be there after a crash once records in it are acknowledged
+			if (fd != -1) fsync_dir(gtfs->dirname);
+		}
+		if (fd != -1) gtfs->segment_fds[seg] = fd;
+	}
+	pthread_mutex_unlock(&gtfs->segment_lock);
+	return fd;
+}
+
+// close the cached descriptors of the segments before seg, which a checkpoint
+// deleted (possibly in another process)
+static void segment_close_below(gtfs_t* gtfs, uint64_t seg) {
+	pthread_mutex_lock(&gtfs->segment_lock);
+	while (!gtfs->segment_fds.empty() && gtfs->segment_fds.begin()->first < seg) {
+		close(gtfs->segment_fds.begin()->second);
+		gtfs->segment_fds.erase(gtfs->segment_fds.begin());
+	}
+	pthread_mutex_unlock(&gtfs->segment_lock);
+}
+
+// read len bytes at log position pos; returns len, or -1 if they are not all there
+static ssize_t log_pread(gtfs_t* gtfs, void* buf, size_t len, uint64_t pos) {
+	size_t done = 0;
+	while (done < len) {
+		uint64_t seg = (pos + done) / gtfs->segment_size;
+		off_t off = (pos + done) % gtfs->segment_size;
+		size_t n = min((uint64_t) (len - done), gtfs->segment_size - off);
+		int fd = segment_fd(gtfs, seg, false);
+		if (fd == -1 || pread(fd, (char*) buf + done, n, off) != (ssize_t) n) return -1;
+		done += n;
+	}
+	return len;
+}
+
+// write iov at log position pos, split at segment boundaries
+static int log_pwritev(gtfs_t* gtfs, const vector<struct iovec>& iov, uint64_t pos) {
+	vector<struct iovec> part;
+	size_t i = 0, skip = 0;
+	while (i < iov.size()) {
+		uint64_t seg = pos / gtfs->segment_size;
+		off_t off = pos % gtfs->segment_size;
+		size_t room = gtfs->segment_size - off, bytes = 0;
+		while (i < iov.size() && bytes < room) {
+			size_t n = min(iov[i].iov_len - skip, room - bytes);
+			struct iovec v = { (char*) iov[i].iov_base + skip, n };
+			part.push_back(v);
+			bytes += n;
+			skip += n;
+			if (skip == iov[i].iov_len) {
+				i++;
+				skip = 0;
+			}
+		}
+		int fd = segment_fd(gtfs, seg, true);
+		if (fd == -1 || pwritev_full(fd, part, off) == -1) {
+			perror("In log_pwritev(), when writing log segment");
+			return -1;
+		}
+		pos += bytes;
+	}
+	return 0;
+}
+
+// make [start, end) of the log durable
+static int log_sync(gtfs_t* gtfs, uint64_t start, uint64_t end) {
+	for (uint64_t seg = start / gtfs->segment_size; start < end && seg <= (end - 1) / gtfs->segment_size; seg++) {
+		int fd = segment_fd(gtfs, seg, false);
+		if (fd == -1 || fdatasync(fd) == -1) {
+			perror("In log_sync(), when syncing log segment");
+			return -1;
+		}
+		stats_add(stats_shard(gtfs).fsyncs, 1);
+	}
+	return 0;
+}
+
+// cut the log at pos: a torn or corrupt record starts there
+static void log_truncate(gtfs_t* gtfs, uint64_t pos) {
+	uint64_t seg = pos / gtfs->segment_size;
+	int fd = segment_fd(gtfs, seg, false);
+	if (fd != -1 && ftruncate(fd, pos % gtfs->segment_size) == -1) perror("In log_truncate(), when truncating log segment");
+	pthread_mutex_lock(&gtfs->segment_lock);
+	while (!gtfs->segment_fds.empty() && gtfs->segment_fds.rbegin()->first > seg) {
+		close(gtfs->segment_fds.rbegin()->second);
+		gtfs->segment_fds.erase(gtfs->segment_fds.rbegin()->first);
+	}
+	pthread_mutex_unlock(&gtfs->segment_lock);
+	while (unlink(segment_path(gtfs, ++seg).c_str()) == 0);
+}
+
+// delete the segments [from, to), whose records are all checkpointed
+static void log_unlink_segments(gtfs_t* gtfs, uint64_t from, uint64_t to) {
+	segment_close_below(gtfs, to);
+	for (uint64_t seg = from; seg < to; seg++) unlink(segment_path(gtfs, seg).c_str());
+}
+
+// persist a new base in the manifest; caller holds the semaphore
+static int log_write_header(gtfs_t* gtfs, uint64_t base) {
+	log_header hdr;
+	hdr.magic = LOG_MAGIC;
+	hdr.version = LOG_FORMAT_VERSION;
+	hdr.base = base;
+	hdr.segment_size = gtfs->segment_size;
+	if (pwrite(gtfs->log_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fdatasync(gtfs->log_fd) == -1) {
+		perror("In log_write_header(), when writing log header");
+		return -1;
+	}
+	stats_add(stats_shard(gtfs).fsyncs, 1);
+	return 0;
+}
+
+// read len bytes at log position pos of a log of format version 1 (from
+// <dir>/log itself) or 2 (from the segments); returns len or -1
+static ssize_t log_pread_v2(gtfs_t* gtfs, bool v1, uint64_t start_lsn, void* buf, size_t len, uint64_t pos) {
+	if (v1) return pread(gtfs->log_fd, buf, len, pos - start_lsn) == (ssize_t) len ? (ssize_t) len : -1;
+	return log_pread(gtfs, buf, len, pos);
+}
+
+// rewrite the valid records of a version 1 or 2 log from pos on with the
+// current record layout, starting at log position new_pos, which ends up
+// after the last record written; padding and voided records are left out.
+// Stops at the first torn or corrupt record. Returns 0 or -1.
+static int log_convert_v2(gtfs_t* gtfs, bool v1, uint64_t start_lsn, uint64_t pos, uint64_t& new_pos) {
+	vector<char> in, out;
+	for (;;) {
+		log_record_header_v2 oh;
+		if (log_pread_v2(gtfs, v1, start_lsn, &oh, sizeof(oh), pos) != sizeof(oh)) break;
+		if (oh.magic != LOG_RECORD_MAGIC || oh.lsn != pos || oh.offset < 0 || oh.length < 0) break;
+		if (oh.filename_length < 0 || oh.filename_length > MAX_FILENAME_LEN) break;
+		log_record_header_v2 h = oh;
+		h.crc = 0;
+		h.valid = 0;
+		if (oh.type == LOG_PAD) {
+			// only its header is checksummed, and its region may not even be written
+			if (~crc32c_update(CRC32C_INIT, &h, sizeof(h)) != oh.crc) break;
+			pos += sizeof(oh) + oh.length;
+			continue;
+		}
+		if (oh.type != LOG_WRITE && oh.type != LOG_TXN && oh.type != LOG_DROP && oh.type != LOG_ZWRITE) break;
+		in.resize(oh.filename_length + oh.length);
+		if (!in.empty() && log_pread_v2(gtfs, v1, start_lsn, &in[0], in.size(), pos + sizeof(oh)) != (ssize_t) in.size()) break;
+		// checksum the record as its version did while converting its data
+		log_record_header rh;
+		memset(&rh, 0, sizeof(rh));
+		rh.magic = LOG_RECORD_MAGIC;
+		rh.filename_length = oh.filename_length;
+		rh.offset = oh.offset;
+		rh.type = oh.type;
+		rh.valid = 1;
+		uint32_t old_crc = CRC32C_INIT, crc = CRC32C_INIT;
+		bool keep = oh.valid == 1, ok = true;
+		out.clear();
+		if (oh.type == LOG_TXN) {
+			size_t p = 0;
+			int ranges = 0;
+			for (int k = 0; k < oh.offset && ok; k++) {
+				txn_range_header_v2 oth;
+				ok = p + sizeof(oth) <= in.size();
+				if (ok) memcpy(&oth, &in[p], sizeof(oth));
+				ok = ok && oth.filename_length > 0 && oth.filename_length <= MAX_FILENAME_LEN && oth.offset >= 0 && oth.length >= 0;
+				ok = ok && p + sizeof(oth) + oth.filename_length + oth.length <= in.size();
+				if (!ok) break;
+				const char* bytes = &in[p + sizeof(oth)];
+				uint8_t valid = oth.valid;
+				oth.valid = 0;
+				old_crc = crc32c_update(old_crc, &oth, sizeof(oth));
+				old_crc = crc32c_update(old_crc, bytes, oth.filename_length + oth.length);
+				if (valid == 1) {
+					txn_range_header th;
+					memset(&th, 0, sizeof(th));
+					th.filename_length = oth.filename_length;
+					th.offset = oth.offset;
+					th.length = oth.length;
+					crc = crc32c_update(crc, &th, sizeof(th));
+					crc = crc32c_update(crc, bytes, th.filename_length + th.length);
+					th.valid = 1;
+					out.insert(out.end(), (char*) &th, (char*) &th + sizeof(th));
+					out.insert(out.end(), bytes, bytes + th.filename_length + th.length);
+					ranges++;
+				}
+				p += sizeof(oth) + oth.filename_length + oth.length;
+			}
+			ok = ok && p == in.size();
+			rh.offset = ranges;
+			keep = ranges > 0;
+		} else {
+			old_crc = crc32c_update(old_crc, in.data(), in.size());
+			if (oh.type == LOG_ZWRITE) {
+				// widen the uncompressed length
+				ok = oh.length >= (int32_t) sizeof(uint32_t);
+				uint32_t raw32 = 0;
+				if (ok) memcpy(&raw32, &in[oh.filename_length], sizeof(raw32));
+				uint64_t raw = raw32;
+				out.assign(in.begin(), in.begin() + oh.filename_length);
+				out.insert(out.end(), (char*) &raw, (char*) &raw + sizeof(raw));
+				if (ok) out.insert(out.end(), in.begin() + oh.filename_length + sizeof(raw32), in.end());
+			} else {
+				out = in;
+			}
+			crc = crc32c_update(crc, out.data(), out.size());
+		}
+		if (!ok || ~crc32c_update(old_crc, &h, sizeof(h)) != oh.crc) break;
+		pos += sizeof(oh) + in.size();
+		if (!keep) continue;
+		rh.lsn = new_pos;
+		rh.length = out.size() - rh.filename_length;
+		rh.crc = log_record_crc(rh, crc);
+		vector<struct iovec> iov(2);
+		iov[0].iov_base = &rh;
+		iov[0].iov_len = sizeof(rh);
+		iov[1].iov_base = out.empty() ? NULL : &out[0];
+		iov[1].iov_len = out.size();
+		if (log_pwritev(gtfs, iov, new_pos) == -1) return -1;
+		new_pos += sizeof(rh) + out.size();
+	}
+	return 0;
+}
+
+// move a log left by an older format into segments of the current one: the
+// original format (int filename_length, filename, int offset, int length,
+// data, valid byte per record, no header) and the records of format version
+// 1 (in <dir>/log itself) and 2 (in segments, with 32-bit offsets and
+// lengths) are rewritten record by record. Version 2 records are rewritten
+// after the last of its segments, which go once the manifest is replaced.
+// Caller holds the semaphore and the whole append gate.
+static int log_migrate(gtfs_t* gtfs, off_t log_size) {
+	VERBOSE_PRINT(do_verbose, "Migrating log inside directory " << gtfs->dirname << " to format version " << LOG_FORMAT_VERSION << "\n");
+	string logpath = gtfs->dirname + "/log";
+	string tmppath = logpath + ".migrate";
+	log_header hdr2;
+	memset(&hdr2, 0, sizeof(hdr2));
+	ssize_t nr = pread(gtfs->log_fd, &hdr2, sizeof(hdr2), 0);
+	log_header_v1 hdr1;
+	memcpy(&hdr1, &hdr2, sizeof(hdr1));
+	bool v1 = nr >= (ssize_t) sizeof(hdr1) && hdr1.magic == LOG_MAGIC && hdr1.version == 1;
+	bool v2 = nr == (ssize_t) sizeof(hdr2) && hdr2.magic == LOG_MAGIC && hdr2.version == 2 && hdr2.segment_size > 0;
+	uint64_t base = 0, new_pos = 0;
+	int ret = 0;
+	vector<char> data;
+	off_t pos = 0;
+	if (v1) {
+		base = new_pos = hdr1.start_lsn + sizeof(hdr1);
+		ret = log_convert_v2(gtfs, true, hdr1.start_lsn, base, new_pos);
+	} else if (v2) {
+		gtfs->segment_size = hdr2.segment_size;
+		uint64_t seg = hdr2.base / gtfs->segment_size;
+		while (access(segment_path(gtfs, seg + 1).c_str(), F_OK) == 0) seg++;
+		base = new_pos = (seg + 1) * gtfs->segment_size;
+		ret = log_convert_v2(gtfs, false, 0, hdr2.base, new_pos);
+	}
+	while (ret == 0 && !v1 && !v2 && pos + (off_t) sizeof(int) <= log_size) {
+		int filename_length, offset, data_length;
+		char fname[MAX_FILENAME_LEN];
+		char valid;
+		if (pread(gtfs->log_fd, &filename_length, sizeof(int), pos) != sizeof(int)) break;
+		if (filename_length <= 0 || filename_length > MAX_FILENAME_LEN) break;
+		off_t p = pos + sizeof(int);
+		if (pread(gtfs->log_fd, fname, filename_length, p) != filename_length) break;
+		p += filename_length;
+		if (pread(gtfs->log_fd, &offset, sizeof(int), p) != sizeof(int)) break;
+		p += sizeof(int);
+		if (pread(gtfs->log_fd, &data_length, sizeof(int), p) != sizeof(int)) break;
+		p += sizeof(int);
+		if (offset < 0 || data_length < 0 || p + data_length + 1 > log_size) break;
+		data.resize(data_length);
+		if (data_length > 0 && pread(gtfs->log_fd, &data[0], data_length, p) != data_length) break;
+		p += data_length;
+		if (pread(gtfs->log_fd, &valid, 1, p) != 1) break;
+		pos = p + 1;
+		if (valid != 1) continue;
+		log_record_header rh;
+		memset(&rh, 0, sizeof(rh));
+		rh.magic = LOG_RECORD_MAGIC;
+		rh.lsn = new_pos;
+		rh.filename_length = filename_length;
+		rh.offset = offset;
+		rh.length = data_length;
+		rh.type = LOG_WRITE;
+		rh.valid = 1;
+		uint32_t crc = crc32c_update(CRC32C_INIT, fname, filename_length);
+		if (data_length > 0) crc = crc32c_update(crc, &data[0], data_length);
+		rh.crc = log_record_crc(rh, crc);
+		vector<struct iovec> iov(3);
+		iov[0].iov_base = &rh;
+		iov[0].iov_len = sizeof(rh);
+		iov[1].iov_base = fname;
+		iov[1].iov_len = filename_length;
+		iov[2].iov_base = data_length > 0 ? &data[0] : NULL;
+		iov[2].iov_len = data_length;
+		ret = log_pwritev(gtfs, iov, new_pos);
+		new_pos += sizeof(rh) + filename_length + data_length;
+	}
+	if (ret == 0) ret = log_sync(gtfs, base, new_pos);
+	// switch to the new format by replacing <dir>/log with a manifest
+	int tmp_fd = ret == 0 ? open(tmppath.c_str(), O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR) : -1;
+	if (tmp_fd != -1) {
+		log_header hdr;
+		hdr.magic = LOG_MAGIC;
+		hdr.version = LOG_FORMAT_VERSION;
+		hdr.base = base;
+		hdr.segment_size = gtfs->segment_size;
+		if (write(tmp_fd, &hdr, sizeof(hdr)) != sizeof(hdr) || fsync(tmp_fd) == -1) ret = -1;
+		close(tmp_fd);
+	} else {
+		ret = -1;
+	}
+	if (ret == 0 && rename(tmppath.c_str(), logpath.c_str()) == -1) ret = -1;
+	if (ret == -1) {
+		perror("In log_migrate(), when writing new log");
+		unlink(tmppath.c_str());
+		return ret;
+	}
+	fsync_dir(gtfs->dirname);
+	close(gtfs->log_fd);
+	gtfs->log_fd = open(logpath.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	if (gtfs->log_fd == -1) perror("In log_migrate(), when reopening log");
+	return gtfs->log_fd == -1 ? -1 : 0;
+}
+
+// on-disk layout of the log index: an idx_header followed by idx_entry
+// records, each one followed by the filename it refers to
+struct idx_header {
+	int magic;
+	int generation;
+};
+
+struct idx_entry {
+	int kind;
+	int filename_length;
+	long long log_offset; // position of the record's data inside the log
+	long long log_end; // end of the record inside the log
+	long long lsn;
+	long long offset;
+	long long length;
+};
+
+static void index_encode(vector<char>& buf, int kind, const char* filename, int filename_length, off_t log_offset, off_t log_end, uint64_t lsn, off_t offset, off_t length) {
+	idx_entry e;
+	memset(&e, 0, sizeof(e));
+	e.kind = kind;
+	e.filename_length = filename_length;
+	e.log_offset = log_offset;
+	e.log_end = log_end;
+	e.lsn = lsn;
+	e.offset = offset;
+	e.length = length;
+	buf.insert(buf.end(), (char*) &e, (char*) &e + sizeof(e));
+	buf.insert(buf.end(), filename, filename + filename_length);
+}
+
+// idx_fd is opened with O_APPEND, so entries of concurrent appenders do not
+// overwrite each other
+static void index_append(gtfs_t* gtfs, vector<char>& buf) {
+	if (buf.empty()) return;
+	if (write(gtfs->idx_fd, &buf[0], buf.size()) != (ssize_t) buf.size()) perror("In index_append(), when writing log index");
+}
+
+// forget the cached descriptor of a file that was removed: a file of that
+// name created since is another one. An empty filename forgets them all.
+// Caller holds the semaphore.
+static void file_fd_drop(gtfs_t* gtfs, const string& filename) {
+	unordered_map<string, file_fd_t>::iterator it;
+	for (it = gtfs->file_fds.begin(); it != gtfs->file_fds.end();) {
+		if (filename.empty() || it->first == filename) {
+			close(it->second.fd);
+			gtfs->file_fds.erase(it++);
+		} else {
+			++it;
+		}
+	}
+}
+
+// start an empty index of a new generation, so that every process notices
+// that the log records it had loaded are gone; caller holds the semaphore
+static void index_reset(gtfs_t* gtfs) {
+	idx_header hdr;
+	int generation = gtfs->idx_generation;
+	if (pread(gtfs->idx_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.magic == IDX_MAGIC && hdr.generation > generation) generation = hdr.generation;
+	generation++;
+	hdr.magic = IDX_MAGIC;
+	hdr.generation = generation;
+	if (ftruncate(gtfs->idx_fd, 0) == -1) perror("In index_reset(), when truncating log index");
+	if (write(gtfs->idx_fd, &hdr, sizeof(hdr)) != sizeof(hdr)) perror("In index_reset(), when writing log index header");
+	gtfs->idx_generation = generation;
+	gtfs->idx_pos = sizeof(hdr);
+	gtfs->log_indexed = 0;
+	gtfs->log_index.clear();
+	gtfs->log_dropped.clear();
+}
+
+// forget the records indexed in [start, end) of the log: an appender that
+// died after indexing them but before publishing them had its region padded
+static void index_void(gtfs_t* gtfs, off_t start, off_t end) {
+	unordered_map<string, vector<log_extent_t> >::iterator it;
+	for (it = gtfs->log_index.begin(); it != gtfs->log_index.end();) {
+		vector<log_extent_t>& extents = it->second;
+		size_t n = 0;
+		for (size_t i = 0; i < extents.size(); i++) {
+			if (extents[i].log_offset < start || extents[i].log_offset >= end) extents[n++] = extents[i];
+		}
+		extents.resize(n);
+		if (extents.empty()) {
+			gtfs->log_index.erase(it++);
+		} else {
+			++it;
+		}
+	}
+	// as is a tombstone there: the remove never returned
+	unordered_map<string, off_t>::iterator d;
+	for (d = gtfs->log_dropped.begin(); d != gtfs->log_dropped.end();) {
+		if (d->second > start && d->second <= end) {
+			gtfs->log_dropped.erase(d++);
+		} else {
+			++d;
+		}
+	}
+}
+
+// load entries appended by ourselves or other processes since last time.
+// Entries of different appenders may land out of log order (and a record may
+// be indexed twice), so extents are kept sorted by their position in the log.
+static void index_load(gtfs_t* gtfs) {
+	struct stat statbuf;
+	fstat(gtfs->idx_fd, &statbuf);
+	while (gtfs->idx_pos + (off_t) sizeof(idx_entry) <= statbuf.st_size) {
+		idx_entry e;
+		char fname[MAX_FILENAME_LEN + 1];
+		if (pread(gtfs->idx_fd, &e, sizeof(e), gtfs->idx_pos) != sizeof(e)) break;
+		if (e.filename_length < 0 || e.filename_length > MAX_FILENAME_LEN) break;
+		if (pread(gtfs->idx_fd, fname, e.filename_length, gtfs->idx_pos + sizeof(e)) != e.filename_length) break;
+		fname[e.filename_length] = '\0';
+		if (e.kind == IDX_EXTENT || e.kind == IDX_TXN_EXTENT || e.kind == IDX_ZEXTENT) {
+			log_extent_t ext;
+			ext.log_offset = e.log_offset;
+			ext.offset = e.offset;
+			ext.length = e.length;
+			ext.packed_length = e.kind == IDX_ZEXTENT ? e.log_end - e.log_offset : 0;
+			// a tombstone voids the file's earlier records, even if their entries
+			// are loaded after it
+			// as are the records a checkpoint already applied
+			unordered_map<string, off_t>::iterator dropped = gtfs->log_dropped.find(string(fname));
+			if (ext.log_offset < (off_t) gtfs->shared->base) {
+			} else if (dropped == gtfs->log_dropped.end() || ext.log_offset >= dropped->second) {
+				vector<log_extent_t>& extents = gtfs->log_index[string(fname)];
+				if (extents.empty() || extents.back().log_offset < ext.log_offset) {
+					extents.push_back(ext);
+				} else {
+					vector<log_extent_t>::iterator it = extents.begin();
+					while (it != extents.end() && it->log_offset < ext.log_offset) ++it;
+					if (it == extents.end() || it->log_offset != ext.log_offset) extents.insert(it, ext);
+				}
+			}
+		} else if (e.kind == IDX_DROP && e.log_end > (off_t) gtfs->shared->base) {
+			// (a checkpoint already cleared the files of older tombstones)
+			off_t& dropped = gtfs->log_dropped[string(fname)];
+			if (e.log_end > dropped) dropped = e.log_end;
+			unordered_map<string, vector<log_extent_t> >::iterator it = gtfs->log_index.find(string(fname));
+			if (it != gtfs->log_index.end()) {
+				vector<log_extent_t>& extents = it->second;
+				size_t n = 0;
+				while (n < extents.size() && extents[n].log_offset < dropped) n++;
+				extents.erase(extents.begin(), extents.begin() + n);
+				if (extents.empty()) gtfs->log_index.erase(it);
+			}
+		} else if (e.kind == IDX_VOID) {
+			index_void(gtfs, e.log_offset, e.log_end);
+		}
+		if (e.log_end > gtfs->log_indexed) gtfs->log_indexed = e.log_end;
+		gtfs->idx_pos += sizeof(e) + e.filename_length;
+	}
+}
+
+// the buffer for reading the log in chunks, allocated on first use; caller
+// holds the semaphore
+static vector<char>& log_scratch(gtfs_t* gtfs) {
+	if (gtfs->scratch.empty()) gtfs->scratch.resize(CHECKPOINT_CHUNK_SIZE);
+	return gtfs->scratch;
+}
+
+// continue crc over [p, end) of the log
+static bool log_crc_range(gtfs_t* gtfs, off_t p, off_t end, uint32_t& crc, vector<char>& scratch) {
+	while (p < end) {
+		size_t len = min((off_t) scratch.size(), end - p);
+		if (log_pread(gtfs, &scratch[0], len, p) != (ssize_t) len) return false;
+		crc = crc32c_update(crc, &scratch[0], len);
+		p += len;
+	}
+	return true;
+}
+
+// verify the ranges of a transaction record, found at [p, end) of the log,
+// continuing crc, and index its valid ranges into entries
+static bool txn_scan(gtfs_t* gtfs, const log_record_header& rh, off_t p, off_t end, uint32_t& crc, vector<char>& scratch, vector<char>& entries) {
+	for (int k = 0; k < rh.offset; k++) {
+		txn_range_header th;
+		char fname[MAX_FILENAME_LEN];
+		if (p + (off_t) sizeof(th) > end || log_pread(gtfs, &th, sizeof(th), p) != sizeof(th)) return false;
+		if (th.filename_length <= 0 || th.filename_length > MAX_FILENAME_LEN || th.offset < 0 || th.length < 0) return false;
+		off_t data_pos = p + sizeof(th) + th.filename_length;
+		if (data_pos > end || th.length > end - data_pos) return false;
+		off_t range_end = data_pos + th.length;
+		if (log_pread(gtfs, fname, th.filename_length, p + sizeof(th)) != th.filename_length) return false;
+		uint8_t valid = th.valid;
+		th.valid = 0;
+		crc = crc32c_update(crc, &th, sizeof(th));
+		crc = crc32c_update(crc, fname, th.filename_length);
+		if (!log_crc_range(gtfs, data_pos, range_end, crc, scratch)) return false;
+		if (valid == 1) index_encode(entries, IDX_TXN_EXTENT, fname, th.filename_length, data_pos, range_end, rh.lsn, th.offset, th.length);
+		p = range_end;
+	}
+	return p == end;
+}
+
+// read the header of the record at pos of the log and check that it is one
+// that fits before end_pos; the rest of the record is not verified
+static bool scan_header(gtfs_t* gtfs, off_t pos, off_t end_pos, log_record_header& rh) {
+	if (pos + (off_t) sizeof(rh) > end_pos) return false;
+	if (log_pread(gtfs, &rh, sizeof(rh), pos) != sizeof(rh)) return false;
+	if (rh.magic != LOG_RECORD_MAGIC || rh.lsn != (uint64_t) pos || rh.offset < 0 || rh.length < 0) return false;
+	if (rh.type != LOG_WRITE && rh.type != LOG_PAD && rh.type != LOG_TXN && rh.type != LOG_DROP && rh.type != LOG_ZWRITE) return false;
+	// padding and transaction records have no filename of their own
+	bool named = rh.type == LOG_WRITE || rh.type == LOG_DROP || rh.type == LOG_ZWRITE;
+	if (named ? (rh.filename_length <= 0 || rh.filename_length > MAX_FILENAME_LEN) : rh.filename_length != 0) return false;
+	if (rh.type == LOG_DROP && rh.length != 0) return false;
+	if (rh.type == LOG_ZWRITE && rh.length < (int64_t) sizeof(uint64_t)) return false;
+	off_t data_pos = pos + sizeof(rh) + rh.filename_length;
+	return data_pos <= end_pos && rh.length <= end_pos - data_pos;
+}
+
+// verify the checksum of a record whose header passed scan_header(), and
+// index it into entries; returns whether it is intact
+static bool scan_record(gtfs_t* gtfs, const log_record_header& rh, vector<char>& scratch, vector<char>& entries) {
+	off_t pos = rh.lsn;
+	off_t data_pos = pos + sizeof(rh) + rh.filename_length;
+	off_t end = data_pos + rh.length;
+	// a padding record covers its length but only its header is checksummed
+	uint32_t crc = CRC32C_INIT;
+	bool ok = true;
+	if (rh.type == LOG_WRITE || rh.type == LOG_DROP || rh.type == LOG_ZWRITE) {
+		char fname[MAX_FILENAME_LEN];
+		ok = log_pread(gtfs, fname, rh.filename_length, pos + sizeof(rh)) == rh.filename_length;
+		crc = crc32c_update(crc, fname, rh.filename_length);
+		ok = ok && log_crc_range(gtfs, data_pos, end, crc, scratch);
+		if (ok && rh.type == LOG_DROP) {
+			index_encode(entries, IDX_DROP, fname, rh.filename_length, end, end, rh.lsn, 0, 0);
+		} else if (ok && rh.valid == 1 && rh.type == LOG_ZWRITE) {
+			uint64_t length;
+			ok = log_pread(gtfs, &length, sizeof(length), data_pos) == sizeof(length) && length <= (uint64_t) INT64_MAX;
+			index_encode(entries, IDX_ZEXTENT, fname, rh.filename_length, data_pos, end, rh.lsn, rh.offset, length);
+		} else if (ok && rh.valid == 1) {
+			index_encode(entries, IDX_EXTENT, fname, rh.filename_length, data_pos, end, rh.lsn, rh.offset, rh.length);
+		}
+	} else if (rh.type == LOG_TXN) {
+		ok = txn_scan(gtfs, rh, data_pos, end, crc, scratch, entries);
+	}
+	return ok && log_record_crc(rh, crc) == rh.crc;
+}
+
+// how many threads recovery scans and checkpoints use
+static int recovery_threads(gtfs_t* gtfs) {
+	if (gtfs->recovery_threads > 0) return gtfs->recovery_threads;
+	return max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+// the buffer of a worker of a parallel_for() for reading the log in chunks:
+// worker 0 (the caller) uses that of gtfs, the others one of scratch
+static vector<char>& worker_scratch(gtfs_t* gtfs, vector<vector<char> >& scratch, int worker) {
+	if (worker == 0) return log_scratch(gtfs);
+	if (scratch[worker].empty()) scratch[worker].resize(CHECKPOINT_CHUNK_SIZE);
+	return scratch[worker];
+}
+
+// records of a recovery scan whose headers were read, to be verified
+struct scan_batch {
+	gtfs_t* gtfs;
+	vector<log_record_header> records;
+	vector<vector<char> > entries; // per record
+	vector<char> ok; // per record
+	vector<vector<char> > scratch; // per worker
+};
+
+static void scan_task(void* arg, int worker, size_t i) {
+	scan_batch* batch = (scan_batch*) arg;
+	vector<char>& scratch = worker_scratch(batch->gtfs, batch->scratch, worker);
+	batch->ok[i] = scan_record(batch->gtfs, batch->records[i], scratch, batch->entries[i]);
+}
+
+// recovery scan: walk the log from pos up to end, verifying every record, and
+// index the valid ones; returns where the scan stopped. It stops at the first
+// torn or corrupt record, and with cut_tail the log is cut there so that later
+// appends are reachable again. The headers are walked in order, and then the
+// checksums of up to SCAN_BATCH_RECORDS records verified on recovery_threads
+// threads.
+static off_t index_scan_log(gtfs_t* gtfs, off_t pos, off_t end_pos, bool cut_tail) {
+	vector<char> buf;
+	if (pos < (off_t) gtfs->shared->base) pos = gtfs->shared->base;
+	off_t indexed = 0;
+	uint64_t scanned = 0;
+	scan_batch batch;
+	batch.gtfs = gtfs;
+	batch.scratch.resize(recovery_threads(gtfs));
+	for (;;) {
+		batch.records.clear();
+		off_t p = pos;
+		log_record_header rh;
+		while (batch.records.size() < SCAN_BATCH_RECORDS && scan_header(gtfs, p, end_pos, rh)) {
+			batch.records.push_back(rh);
+			p += sizeof(rh) + rh.filename_length + rh.length;
+		}
+		if (batch.records.empty()) break;
+		batch.entries.assign(batch.records.size(), vector<char>());
+		batch.ok.assign(batch.records.size(), 0);
+		parallel_for(batch.scratch.size(), batch.records.size(), scan_task, &batch);
+		size_t i = 0;
+		for (; i < batch.records.size() && batch.ok[i]; i++) {
+			const log_record_header& r = batch.records[i];
+			off_t end = pos + sizeof(r) + r.filename_length + r.length;
+			scanned++;
+			if (!batch.entries[i].empty()) {
+				buf.insert(buf.end(), batch.entries[i].begin(), batch.entries[i].end());
+				indexed = end;
+			}
+			pos = end;
+		}
+		if (i < batch.records.size()) break;
+	}
+	if (cut_tail) {
+		// also drops what unacknowledged appenders left further on
+		char c;
+		if (log_pread(gtfs, &c, 1, pos) == 1) VERBOSE_PRINT(do_verbose, "Dropping torn or corrupt log tail at " << pos << " inside directory " << gtfs->dirname << "\n");
+		log_truncate(gtfs, pos);
+	}
+	// remember how far the log was scanned even if it ended with invalid records
+	if (indexed < pos) index_encode(buf, IDX_MARK, "", 0, 0, pos, pos, 0, 0);
+	index_append(gtfs, buf);
+	stats_add(stats_shard(gtfs).scanned_records, scanned);
+	return pos;
+}
+
+// bring the in-memory index up to date with the index file and the published
+// part of the log; caller holds the semaphore
+static void index_refresh(gtfs_t* gtfs) {
+	// every record below published has its index entries written already
+	off_t published = __atomic_load_n(&gtfs->shared->published, __ATOMIC_SEQ_CST);
+	idx_header hdr;
+	if (pread(gtfs->idx_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != IDX_MAGIC) {
+		// missing or damaged index: rebuild it from the whole log
+		index_reset(gtfs);
+		file_fd_drop(gtfs, "");
+	} else if (hdr.generation != gtfs->idx_generation) {
+		// the index was reset or rebuilt since we last loaded it
+		gtfs->idx_generation = hdr.generation;
+		gtfs->idx_pos = sizeof(hdr);
+		gtfs->log_indexed = 0;
+		gtfs->log_index.clear();
+		gtfs->log_dropped.clear();
+		// files removed before the checkpoint have no tombstone left to tell
+		file_fd_drop(gtfs, "");
+		// a checkpoint moved the base of the log and deleted the segments below it
+		segment_close_below(gtfs, gtfs->shared->base / gtfs->segment_size);
+	}
+	index_load(gtfs);
+	if (max(gtfs->log_indexed, (off_t) gtfs->shared->base) < published) {
+		// records without an index entry (e.g. the index file was lost)
+		index_scan_log(gtfs, gtfs->log_indexed, published, false);
+		index_load(gtfs);
+	}
+}
+
+static bool process_alive(pid_t pid) {
+	return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+// find the per-file entry of filename, taking a free one if create is set;
+// caller holds the semaphore; returns -1 if there is none
+static int shared_file_find(gtfs_shared* sh, const string& filename, bool create) {
+	int free_entry = -1;
+	for (int i = 0; i < MAX_NUM_FILES_PER_DIR; i++) {
+		if (sh->files[i].filename[0] == '\0') {
+			if (free_entry == -1) free_entry = i;
+		} else if (filename == sh->files[i].filename) {
+			return i;
+		}
+	}
+	if (!create || free_entry == -1) return -1;
+	shared_file& f = sh->files[free_entry];
+	strncpy(f.filename, filename.c_str(), MAX_FILENAME_LEN);
+	f.filename[MAX_FILENAME_LEN] = '\0';
+	f.open_count = 0;
+	f.record_count = 0;
+	return free_entry;
+}
+
+// forget the log records counted since the last checkpoint; caller holds the
+// semaphore and the whole append gate
+static void shared_files_reset(gtfs_shared* sh) {
+	for (int i = 0; i < MAX_NUM_FILES_PER_DIR; i++) {
+		sh->files[i].record_count = 0;
+		if (sh->files[i].open_count <= 0) sh->files[i].filename[0] = '\0';
+	}
+}
+
+// take a free appender slot, or one left behind by a dead process
+static int shared_claim_slot(gtfs_shared* sh) {
+	pid_t me = getpid();
+	for (;;) {
+		for (int i = 0; i < SHARED_MAX_APPENDERS; i++) {
+			pid_t pid = __atomic_load_n(&sh->slots[i].pid, __ATOMIC_SEQ_CST);
+			if (pid != 0 && (pid == me || process_alive(pid))) continue;
+			if (__atomic_compare_exchange_n(&sh->slots[i].pid, &pid, me, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+				__atomic_store_n(&sh->slots[i].reserved, 0, __ATOMIC_SEQ_CST);
+				return i;
+			}
+		}
+		sched_yield();
+	}
+}
+
+static void shared_release_slot(gtfs_shared* sh, int slot) {
+	__atomic_store_n(&sh->slots[slot].reserved, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&sh->slots[slot].pid, 0, __ATOMIC_SEQ_CST);
+}
+
+// overwrite [start, end) of the log with one padding record that recovery
+// skips, and index it as scanned; the padding only covers the header of what
+// was there, so whatever was indexed in the region is voided too
+static int log_write_pad(gtfs_t* gtfs, uint64_t start, uint64_t end) {
+	log_record_header rh;
+	memset(&rh, 0, sizeof(rh));
+	rh.magic = LOG_RECORD_MAGIC;
+	rh.lsn = start;
+	rh.length = end - start - sizeof(rh);
+	rh.type = LOG_PAD;
+	rh.crc = log_record_crc(rh, CRC32C_INIT);
+	vector<struct iovec> iov(1);
+	iov[0].iov_base = &rh;
+	iov[0].iov_len = sizeof(rh);
+	if (log_pwritev(gtfs, iov, start) == -1 || log_sync(gtfs, start, start + sizeof(rh)) == -1) {
+		perror("In log_write_pad(), when writing padding record");
+		return -1;
+	}
+	vector<char> buf;
+	index_encode(buf, IDX_VOID, "", 0, start, end, rh.lsn, 0, 0);
+	index_append(gtfs, buf);
+	return 0;
+}
+
+// pad [pub, end), the region at published, and publish past it. If the
+// padding cannot be written, the region is left as a hole: recovery would stop
+// there, so nothing after it is published until someone pads it. Caller owns
+// the region or is the rescuer; returns 0 or -1.
+static int shared_pad(gtfs_t* gtfs, uint64_t pub, uint64_t end) {
+	gtfs_shared* sh = gtfs->shared;
+	if (log_write_pad(gtfs, pub, end) == -1) {
+		__atomic_store_n(&sh->hole_end, end, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+	__atomic_store_n(&sh->hole_end, 0, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&sh->published, end, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+// the region starting at published was reserved by an appender that is not
+// making progress: if it died, pad its region and publish past it. A hole left
+// by a padding that failed is padded again.
+static void shared_rescue(gtfs_t* gtfs, uint64_t pub) {
+	gtfs_shared* sh = gtfs->shared;
+	uint64_t end = __atomic_load_n(&sh->log_tail, __ATOMIC_SEQ_CST);
+	uint64_t hole = __atomic_load_n(&sh->hole_end, __ATOMIC_SEQ_CST);
+	if (hole > pub) end = hole;
+	for (int i = 0; i < SHARED_MAX_APPENDERS && hole <= pub; i++) {
+		shared_slot& s = sh->slots[i];
+		pid_t pid = __atomic_load_n(&s.pid, __ATOMIC_SEQ_CST);
+		if (pid == 0) continue;
+		bool alive = process_alive(pid);
+		if (!__atomic_load_n(&s.reserved, __ATOMIC_SEQ_CST)) {
+			// it may be about to record the region at published
+			if (alive) return;
+			continue;
+		}
+		uint64_t start = __atomic_load_n(&s.start, __ATOMIC_SEQ_CST);
+		if (start == pub) {
+			if (alive) return;
+			end = pub + __atomic_load_n(&s.length, __ATOMIC_SEQ_CST);
+			break;
+		}
+		// the slot of a reclaimed region is gone: it ends where the next one starts
+		if (start > pub && start < end) end = start;
+	}
+	if (end <= pub) return;
+	pid_t me = getpid(), holder = 0;
+	if (!__atomic_compare_exchange_n(&sh->rescuer, &holder, me, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		if (process_alive(holder) || !__atomic_compare_exchange_n(&sh->rescuer, &holder, me, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return;
+	}
+	if (__atomic_load_n(&sh->published, __ATOMIC_SEQ_CST) == pub) {
+		VERBOSE_PRINT(do_verbose, "Padding log region [" << pub << ", " << end << ") of a dead appender inside directory " << gtfs->dirname << "\n");
+		shared_pad(gtfs, pub, end);
+	}
+	__atomic_store_n(&sh->rescuer, 0, __ATOMIC_SEQ_CST);
+}
+
+// wait until every region before start is published; returns -1 if one of
+// them is a hole that still cannot be padded
+static int shared_wait_turn(gtfs_t* gtfs, uint64_t start) {
+	gtfs_shared* sh = gtfs->shared;
+	uint64_t last = __atomic_load_n(&sh->published, __ATOMIC_SEQ_CST);
+	struct timeval since, now;
+	gettimeofday(&since, NULL);
+	for (int spins = 0;; spins++) {
+		uint64_t pub = __atomic_load_n(&sh->published, __ATOMIC_SEQ_CST);
+		if (pub == start) return 0;
+		if (__atomic_load_n(&sh->hole_end, __ATOMIC_SEQ_CST) > pub) {
+			shared_rescue(gtfs, pub);
+			uint64_t hole = __atomic_load_n(&sh->hole_end, __ATOMIC_SEQ_CST);
+			if (hole != 0 && hole > __atomic_load_n(&sh->published, __ATOMIC_SEQ_CST)) return -1;
+			continue;
+		}
+		if (spins < 64) {
+			sched_yield();
+		} else {
+			// the appender ahead of us is usually inside fdatasync()
+			usleep(50);
+		}
+		gettimeofday(&now, NULL);
+		if (pub != last) {
+			last = pub;
+			since = now;
+		} else if ((now.tv_sec - since.tv_sec) * 1000000LL + now.tv_usec - since.tv_usec >= APPEND_RESCUE_CHECK_US) {
+			shared_rescue(gtfs, pub);
+			since = now;
+		}
+	}
+}
+
+// rebuild the shared control block from the log (after a reboot, or when the
+// segment belonged to another log): cut a torn tail, bring the index up to
+// date and append after the last valid record; caller holds the semaphore and
+// the whole append gate
+static void shared_recover(gtfs_t* gtfs) {
+	gtfs_shared* sh = gtfs->shared;
+	VERBOSE_PRINT(do_verbose, "Recovering log inside directory " << gtfs->dirname << "\n");
+	memset(sh, 0, sizeof(*sh));
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	sh->epoch = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	struct stat statbuf;
+	fstat(gtfs->log_fd, &statbuf);
+	log_header lh;
+	if (statbuf.st_size < (off_t) sizeof(log_header) || pread(gtfs->log_fd, &lh, sizeof(lh), 0) != sizeof(lh)) {
+		// new directory
+		gtfs->segment_size = DEFAULT_LOG_SEGMENT_SIZE;
+		log_write_header(gtfs, 0);
+		index_reset(gtfs);
+		lh.base = 0;
+	} else {
+		gtfs->segment_size = lh.segment_size;
+		// segments a checkpoint did not get to delete before a crash
+		log_unlink_segments(gtfs, 0, lh.base / gtfs->segment_size);
+	}
+	sh->base = lh.base;
+	sh->segment_size = gtfs->segment_size;
+	idx_header hdr;
+	if (pread(gtfs->idx_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || hdr.magic != IDX_MAGIC) {
+		index_reset(gtfs);
+	} else {
+		gtfs->idx_generation = hdr.generation;
+		gtfs->idx_pos = sizeof(hdr);
+		gtfs->log_indexed = 0;
+		gtfs->log_index.clear();
+		gtfs->log_dropped.clear();
+		index_load(gtfs);
+		struct stat idx_stat;
+		fstat(gtfs->idx_fd, &idx_stat);
+		if (gtfs->idx_pos < idx_stat.st_size) {
+			// torn entry left by a crash: drop it, the log scan below re-creates it
+			if (ftruncate(gtfs->idx_fd, gtfs->idx_pos) == -1) perror("In shared_recover(), when truncating log index");
+		}
+		// the log was cut behind the index's back: start over
+		char c;
+		if (gtfs->log_indexed > (off_t) sh->base && log_pread(gtfs, &c, 1, gtfs->log_indexed - 1) != 1) index_reset(gtfs);
+	}
+	off_t end = index_scan_log(gtfs, max(gtfs->log_indexed, (off_t) sh->base), LLONG_MAX, true);
+	index_load(gtfs);
+	sh->log_dev = statbuf.st_dev;
+	sh->log_ino = statbuf.st_ino;
+	sh->log_tail = sh->published = end;
+	unordered_map<string, vector<log_extent_t> >::iterator it;
+	for (it = gtfs->log_index.begin(); it != gtfs->log_index.end(); ++it) {
+		int f = shared_file_find(sh, it->first, true);
+		if (f != -1) sh->files[f].record_count = it->second.size();
+	}
+	__atomic_store_n(&sh->magic, SHARED_MAGIC, __ATOMIC_SEQ_CST);
+}
+
+// the data of the compressed record last read by extent_read(), so that
+// reading it piece by piece decompresses it once
+struct log_unpacked {
+	off_t log_offset; // of the record, -1 if none
+	vector<char> data;
+	log_unpacked() : log_offset(-1) {}
+};
+
+// read [from, from + length) of the data of a log record into buf; returns 0
+// or -1. Caller holds the semaphore.
+static int extent_read(gtfs_t* gtfs, const log_extent_t& e, off_t from, off_t length, char* buf, log_unpacked& unpacked) {
+	if (e.packed_length == 0) return log_pread(gtfs, buf, length, e.log_offset + from) == length ? 0 : -1;
+	if (unpacked.log_offset != e.log_offset) {
+		unpacked.log_offset = -1;
+		// only records of at most INT_MAX bytes are compressed
+		off_t skip = sizeof(uint64_t);
+		if (e.length > INT_MAX || e.packed_length - skip > INT_MAX) {
+			errno = EIO;
+			return -1;
+		}
+		vector<char> packed(e.packed_length);
+		if (log_pread(gtfs, &packed[0], e.packed_length, e.log_offset) != e.packed_length) return -1;
+		unpacked.data.resize(e.length);
+		if (lz_decompress(&packed[skip], e.packed_length - skip, &unpacked.data[0], e.length) == -1) {
+			errno = EIO;
+			return -1;
+		}
+		unpacked.log_offset = e.log_offset;
+	}
+	memcpy(buf, &unpacked.data[from], length);
+	return 0;
+}
+
+// a piece of a file whose final content (after coalescing) is in the log
+struct ckpt_seg {
+	off_t end;
+	const log_extent_t* extent; // the record holding the piece
+};
+
+// add a log record to the coalesced view of a file; later records win over
+// the parts of earlier ones they overlap
+static void ckpt_coalesce(map<off_t, ckpt_seg>& segs, const log_extent_t& e) {
+	off_t start = e.offset, end = e.offset + e.length;
+	if (start >= end) return;
+	map<off_t, ckpt_seg>::iterator it = segs.lower_bound(start);
+	if (it != segs.begin()) {
+		map<off_t, ckpt_seg>::iterator prev = it;
+		--prev;
+		if (prev->second.end > start) {
+			if (prev->second.end > end) {
+				ckpt_seg rest = { prev->second.end, prev->second.extent };
+				segs[end] = rest;
+			}
+			prev->second.end = start;
+		}
+	}
+	it = segs.lower_bound(start);
+	while (it != segs.end() && it->first < end) {
+		if (it->second.end > end) {
+			ckpt_seg rest = { it->second.end, it->second.extent };
+			segs.erase(it);
+			segs[end] = rest;
+			break;
+		}
+		segs.erase(it++);
+	}
+	ckpt_seg seg = { end, &e };
+	segs[start] = seg;
+}
+
+// extend the file open as fd from size bytes to length, allocating its blocks
+// with gtfs->file_prealloc; never shrinks it, even if size is out of date.
+// Returns 0 or -1.
+static int file_extend(gtfs_t* gtfs, int fd, off_t size, off_t length) {
+	if (length <= size) return 0;
+	if (gtfs->file_prealloc) {
+		if (fallocate(fd, 0, size, length - size) == 0) return 0;
+		// not every file system supports it
+		if (errno != EOPNOTSUPP) {
+			perror("In file_extend(), when allocating file");
+			return -1;
+		}
+	}
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) == 0 && statbuf.st_size >= length) return 0;
+	if (ftruncate(fd, length) == -1) {
+		perror("In file_extend(), when extending file");
+		return -1;
+	}
+	return 0;
+}
+
+// the cached descriptor of a file, opening it on first use; NULL if it cannot
+// be opened (errno tells whether it is gone). The cache may grow past
+// FILE_FD_CACHE_MAX here, so that the entries a checkpoint collected stay
+// valid until file_fd_trim(). Caller holds the semaphore.
+static file_fd_t* file_fd_get(gtfs_t* gtfs, const string& filename) {
+	unordered_map<string, file_fd_t>::iterator it = gtfs->file_fds.find(filename);
+	if (it != gtfs->file_fds.end()) return &it->second;
+	file_fd_t ff;
+	ff.fd = open((gtfs->dirname + "/" + filename).c_str(), O_RDWR);
+	if (ff.fd == -1) return NULL;
+	struct stat statbuf;
+	ff.size = fstat(ff.fd, &statbuf) == 0 ? statbuf.st_size : 0;
+	return &(gtfs->file_fds[filename] = ff);
+}
+
+// close cached descriptors until at most FILE_FD_CACHE_MAX are left, once no
+// checkpoint uses them. Caller holds the semaphore.
+static void file_fd_trim(gtfs_t* gtfs) {
+	while (gtfs->file_fds.size() > FILE_FD_CACHE_MAX) {
+		close(gtfs->file_fds.begin()->second.fd);
+		gtfs->file_fds.erase(gtfs->file_fds.begin());
+	}
+}
+
+// apply the coalesced log records of one file that lie before cut, and fsync
+// the file once
+static int ckpt_apply_file(gtfs_t* gtfs, file_fd_t* ff, vector<log_extent_t>& extents, off_t cut, vector<char>& scratch) {
+	map<off_t, ckpt_seg> segs;
+	for (size_t i = 0; i < extents.size() && extents[i].log_offset < cut; i++) ckpt_coalesce(segs, extents[i]);
+	if (segs.empty()) return 0;
+	int fd = ff->fd;
+	int ret = 0;
+	// allocate what the records add to the file at once
+	off_t end = segs.rbegin()->second.end;
+	if (gtfs->file_prealloc && end > ff->size) {
+		ret = file_extend(gtfs, fd, ff->size, end);
+		if (ret == 0) ff->size = end;
+	}
+	vector<struct iovec> iov;
+	off_t run_start = 0, run_end = 0;
+	size_t used = 0;
+	log_unpacked unpacked;
+	for (map<off_t, ckpt_seg>::iterator it = segs.begin(); it != segs.end() && ret == 0; ++it) {
+		off_t start = it->first;
+		const log_extent_t& e = *it->second.extent;
+		while (start < it->second.end && ret == 0) {
+			// flush the run when the next piece is not contiguous or scratch is full
+			if (!iov.empty() && (start != run_end || used == scratch.size())) {
+				ret = pwritev_full(fd, iov, run_start);
+				used = 0;
+			}
+			if (iov.empty()) run_start = run_end = start;
+			size_t len = min((size_t) (it->second.end - start), scratch.size() - used);
+			if (extent_read(gtfs, e, start - e.offset, len, &scratch[used], unpacked) == -1) {
+				perror("In ckpt_apply_file(), when reading log");
+				ret = -1;
+				break;
+			}
+			struct iovec v = { &scratch[used], len };
+			iov.push_back(v);
+			used += len;
+			start += len;
+			run_end = start;
+		}
+	}
+	if (ret == 0 && !iov.empty()) ret = pwritev_full(fd, iov, run_start);
+	if (ret == 0 && fsync(fd) == -1) {
+		perror("In ckpt_apply_file(), when syncing file");
+		ret = -1;
+	}
+	stats_add(stats_shard(gtfs).fsyncs, 1);
+	if (end > ff->size) ff->size = end;
+	return ret;
+}
+
+// zero the content of a removed file that is still there, keeping its size:
+// a remove that crashed after its tombstone was durable left it behind.
+// Caller holds the semaphore.
+static int file_clear_dropped(gtfs_t* gtfs, const string& filename, bool sync) {
+	int fd = open((gtfs->dirname + "/" + filename).c_str(), O_RDWR);
+	if (fd == -1) return errno == ENOENT ? 0 : -1;
+	struct stat statbuf;
+	int ret = fstat(fd, &statbuf);
+	vector<char> zeros(min((off_t) CHECKPOINT_CHUNK_SIZE, statbuf.st_size));
+	for (off_t pos = 0; ret == 0 && pos < statbuf.st_size; pos += zeros.size()) {
+		size_t len = min((off_t) zeros.size(), statbuf.st_size - pos);
+		if (pwrite(fd, &zeros[0], len, pos) != (ssize_t) len) ret = -1;
+	}
+	if (ret == 0 && sync && statbuf.st_size > 0) {
+		ret = fsync(fd);
+		stats_add(stats_shard(gtfs).fsyncs, 1);
+	}
+	if (ret == -1) perror("In file_clear_dropped(), when clearing removed file");
+	close(fd);
+	return ret;
+}
+
+// the files a checkpoint applies records to, one task per file
+struct ckpt_work {
+	gtfs_t* gtfs;
+	off_t cut;
+	vector<pair<size_t, unordered_map<string, vector<log_extent_t> >::iterator> > files; // by number of records
+	vector<file_fd_t*> fds; // per file
+	vector<vector<char> > scratch; // per worker
+	bool failed;
+};
+
+static bool ckpt_larger(const pair<size_t, unordered_map<string, vector<log_extent_t> >::iterator>& a, const pair<size_t, unordered_map<string, vector<log_extent_t> >::iterator>& b) {
+	return a.first > b.first;
+}
+
+static void ckpt_task(void* arg, int worker, size_t i) {
+	ckpt_work* work = (ckpt_work*) arg;
+	vector<char>& scratch = worker_scratch(work->gtfs, work->scratch, worker);
+	unordered_map<string, vector<log_extent_t> >::iterator it = work->files[i].second;
+	if (work->fds[i] != NULL && ckpt_apply_file(work->gtfs, work->fds[i], it->second, work->cut, scratch) == -1) __atomic_store_n(&work->failed, true, __ATOMIC_SEQ_CST);
+}
+
+// persist every published log record into its file, move the base of the log
+// past them and delete the segments they were in. Appenders are only held off
+// while the index is rewritten, unless exclusive is set, in which case the
+// checkpoint covers the whole log. Caller must not hold the semaphore.
+static int checkpoint(gtfs_t* gtfs, bool exclusive) {
+	int ret = 0;
+	gtfs_shared* sh = gtfs->shared;
+	dir_lock(gtfs);
+	// wait for the appenders in flight and keep new ones out
+	if (exclusive) dir_sem_op(gtfs->gate_id, -APPEND_GATE_MAX);
+	uint64_t old_base = sh->base;
+	off_t cut = __atomic_load_n(&sh->published, __ATOMIC_SEQ_CST);
+	index_refresh(gtfs);
+	// the tombstones before cut are forgotten once the base moves past them
+	unordered_map<string, off_t>::iterator d;
+	for (d = gtfs->log_dropped.begin(); d != gtfs->log_dropped.end(); ++d) {
+		file_fd_drop(gtfs, d->first);
+		if (d->second <= cut && file_clear_dropped(gtfs, d->first, true) == -1) ret = -1;
+	}
+	// files are independent: they are applied in parallel, those with the most
+	// records first so that none of them is left to run alone at the end
+	ckpt_work work;
+	work.gtfs = gtfs;
+	work.cut = cut;
+	work.failed = false;
+	unordered_map<string, vector<log_extent_t> >::iterator it;
+	for (it = gtfs->log_index.begin(); it != gtfs->log_index.end(); ++it) {
+		if (!it->second.empty() && it->second[0].log_offset < cut) work.files.push_back(make_pair(it->second.size(), it));
+	}
+	sort(work.files.begin(), work.files.end(), ckpt_larger);
+	// the descriptors are looked up (or opened) here, the cache is not shared
+	// with the workers
+	for (size_t i = 0; i < work.files.size(); i++) {
+		work.fds.push_back(file_fd_get(gtfs, work.files[i].second->first));
+		if (work.fds.back() == NULL) {
+			perror("In checkpoint(), when opening file");
+			// unless the file is gone, its records stay in the log for the next
+			// checkpoint
+			if (errno != ENOENT) ret = -1;
+		}
+	}
+	work.scratch.resize(recovery_threads(gtfs));
+	parallel_for(work.scratch.size(), work.files.size(), ckpt_task, &work);
+	file_fd_trim(gtfs);
+	if (work.failed) ret = -1;
+	// the files hold everything before cut now; if we crash before the base
+	// moves, those records are simply applied again
+	if (ret == 0 && (uint64_t) cut > old_base) ret = log_write_header(gtfs, cut);
+	if (ret == 0 && (uint64_t) cut > old_base) {
+		if (!exclusive) dir_sem_op(gtfs->gate_id, -APPEND_GATE_MAX);
+		index_load(gtfs);
+		__atomic_store_n(&sh->base, cut, __ATOMIC_SEQ_CST);
+		// rewrite the index without the records before the base; this also makes
+		// every process reload it and close the segments about to go
+		off_t indexed = gtfs->log_indexed;
+		unordered_map<string, vector<log_extent_t> > extents;
+		extents.swap(gtfs->log_index);
+		unordered_map<string, off_t> dropped;
+		dropped.swap(gtfs->log_dropped);
+		index_reset(gtfs);
+		vector<char> buf;
+		for (d = dropped.begin(); d != dropped.end(); ++d) {
+			if (d->second > cut) index_encode(buf, IDX_DROP, d->first.c_str(), d->first.size(), d->second, d->second, d->second, 0, 0);
+		}
+		for (it = extents.begin(); it != extents.end(); ++it) {
+			for (size_t i = 0; i < it->second.size(); i++) {
+				const log_extent_t& e = it->second[i];
+				if (e.log_offset < cut) continue;
+				if (e.packed_length) {
+					index_encode(buf, IDX_ZEXTENT, it->first.c_str(), it->first.size(), e.log_offset, e.log_offset + e.packed_length, e.log_offset, e.offset, e.length);
+				} else {
+					index_encode(buf, IDX_EXTENT, it->first.c_str(), it->first.size(), e.log_offset, e.log_offset + e.length, e.log_offset, e.offset, e.length);
+				}
+			}
+		}
+		index_encode(buf, IDX_MARK, "", 0, 0, max(indexed, cut), max(indexed, cut), 0, 0);
+		index_append(gtfs, buf);
+		index_load(gtfs);
+		// count what is left of the log per file
+		shared_files_reset(sh);
+		for (it = gtfs->log_index.begin(); it != gtfs->log_index.end(); ++it) {
+			int f = shared_file_find(sh, it->first, true);
+			if (f != -1) sh->files[f].record_count = it->second.size();
+		}
+		if (!exclusive) dir_sem_op(gtfs->gate_id, APPEND_GATE_MAX);
+		log_unlink_segments(gtfs, old_base / gtfs->segment_size, cut / gtfs->segment_size);
+	}
+	if (exclusive) dir_sem_op(gtfs->gate_id, APPEND_GATE_MAX);
+	dir_unlock(gtfs);
+	return ret;
+}
+
+static void* checkpoint_thread(void* arg) {
+	gtfs_t* gtfs = (gtfs_t*) arg;
+	pthread_mutex_lock(&gtfs->checkpoint_lock);
+	for (;;) {
+		while (!gtfs->checkpoint_requested) pthread_cond_wait(&gtfs->checkpoint_cond, &gtfs->checkpoint_lock);
+		gtfs->checkpoint_requested = false;
+		pthread_mutex_unlock(&gtfs->checkpoint_lock);
+		VERBOSE_PRINT(do_verbose, "Checkpointing log inside directory " << gtfs->dirname << " in the background\n");
+		checkpoint(gtfs, false);
+		pthread_mutex_lock(&gtfs->checkpoint_lock);
+	}
+	return NULL;
+}
+
+// wake the background checkpointer, starting it on first use
+static void checkpoint_request(gtfs_t* gtfs) {
+	pthread_mutex_lock(&gtfs->checkpoint_lock);
+	if (!gtfs->checkpoint_started) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, checkpoint_thread, gtfs) == 0) {
+			pthread_detach(tid);
+			gtfs->checkpoint_started = true;
+		} else {
+			perror("In checkpoint_request(), when starting checkpointer");
+		}
+	}
+	gtfs->checkpoint_requested = true;
+	pthread_cond_signal(&gtfs->checkpoint_cond);
+	pthread_mutex_unlock(&gtfs->checkpoint_lock);
+}
+
+// one pending log record waiting for a group commit leader to persist it
+struct commit_req {
+	log_record_header hdr; // lsn and crc are filled in by the leader
+	uint32_t payload_crc; // computed by the syncer, outside of any lock
+	struct iovec iov[COMMIT_REQ_IOVCNT]; // LOG_TXN: header and ranges only
+	bool done;
+	int ret;
+	// asynchronous requests: nobody waits for them, the leader calls complete
+	// once the record is durable (or failed), which also frees the request
+	void (*complete)(struct commit_req* req);
+	uint64_t submitted; // stats_now() when it was queued
+	write_t* write;
+	gtfs_sync_callback_t callback;
+	void* callback_arg;
+	vector<char> packed; // LOG_ZWRITE: the record's data
+};
+
+// index entries of a record that is about to be published at pos
+static void index_encode_record(vector<char>& buf, const commit_req* req, off_t pos) {
+	const log_record_header& rh = req->hdr;
+	off_t data_pos = pos + sizeof(rh) + rh.filename_length;
+	if (rh.type == LOG_WRITE) {
+		index_encode(buf, IDX_EXTENT, (const char*) req->iov[1].iov_base, rh.filename_length, data_pos, data_pos + rh.length, rh.lsn, rh.offset, rh.length);
+		return;
+	}
+	if (rh.type == LOG_ZWRITE) {
+		uint64_t length;
+		memcpy(&length, req->iov[2].iov_base, sizeof(length));
+		index_encode(buf, IDX_ZEXTENT, (const char*) req->iov[1].iov_base, rh.filename_length, data_pos, data_pos + rh.length, rh.lsn, rh.offset, length);
+		return;
+	}
+	if (rh.type == LOG_DROP) {
+		index_encode(buf, IDX_DROP, (const char*) req->iov[1].iov_base, rh.filename_length, data_pos, data_pos, rh.lsn, 0, 0);
+		return;
+	}
+	const char* p = (const char*) req->iov[1].iov_base;
+	for (int k = 0; k < rh.offset; k++) {
+		txn_range_header th;
+		memcpy(&th, p, sizeof(th));
+		const char* fname = p + sizeof(th);
+		off_t range_pos = data_pos + (p - (const char*) req->iov[1].iov_base) + sizeof(th) + th.filename_length;
+		index_encode(buf, IDX_TXN_EXTENT, fname, th.filename_length, range_pos, range_pos + th.length, rh.lsn, th.offset, th.length);
+		p += sizeof(th) + th.filename_length + th.length;
+	}
+}
+
+// append the records of a batch to the log with one pwritev() and make them
+// durable with one fdatasync() (per segment touched); sets ret of every
+// request in the batch and returns how much log is left to checkpoint
+static off_t flush_batch(gtfs_t* gtfs, commit_req** batch, int n) {
+	gtfs_shared* sh = gtfs->shared;
+	vector<struct iovec> iov;
+	uint64_t len = 0;
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < COMMIT_REQ_IOVCNT; j++) {
+			iov.push_back(batch[i]->iov[j]);
+			len += batch[i]->iov[j].iov_len;
+		}
+	}
+	int ret = 0;
+	uint64_t wait_start = stats_now();
+	dir_sem_op(gtfs->gate_id, -1);
+	stats_wait(gtfs, wait_start);
+	// reserve a region of the log; the slot tells others who is filling it
+	int slot = shared_claim_slot(sh);
+	uint64_t start = __atomic_fetch_add(&sh->log_tail, len, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&sh->slots[slot].start, start, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&sh->slots[slot].length, len, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&sh->slots[slot].reserved, 1, __ATOMIC_SEQ_CST);
+	uint64_t pos = start;
+	for (int i = 0; i < n; i++) {
+		log_record_header& rh = batch[i]->hdr;
+		rh.lsn = pos;
+		rh.crc = log_record_crc(rh, batch[i]->payload_crc);
+		pos += sizeof(rh) + rh.filename_length + rh.length;
+	}
+	ret = log_pwritev(gtfs, iov, start);
+	if (ret == 0) ret = log_sync(gtfs, start, start + len);
+	if (shared_wait_turn(gtfs, start) == -1) {
+		// a region before ours could not be padded, so ours cannot be published
+		// either; once the hole is padded, ours is padded as a reclaimed one
+		ret = -1;
+	} else if (ret == 0) {
+		// index the new records; the index is not synced since a stale one is
+		// caught up from the log by index_refresh()
+		vector<char> buf;
+		pos = start;
+		for (int i = 0; i < n; i++) {
+			log_record_header& rh = batch[i]->hdr;
+			index_encode_record(buf, batch[i], pos);
+			pos += sizeof(rh) + rh.filename_length + rh.length;
+		}
+		index_append(gtfs, buf);
+		__atomic_store_n(&sh->published, start + len, __ATOMIC_SEQ_CST);
+	} else {
+		// the region may hold part of the batch: make recovery skip all of it
+		shared_pad(gtfs, start, start + len);
+	}
+	shared_release_slot(sh, slot);
+	dir_sem_op(gtfs->gate_id, 1);
+	for (int i = 0; i < n; i++) batch[i]->ret = ret;
+	if (ret == 0) {
+		gtfs_stats_t& st = stats_shard(gtfs);
+		stats_add(st.log_records, n);
+		stats_add(st.log_bytes, len);
+	}
+	return start + len - __atomic_load_n(&sh->base, __ATOMIC_SEQ_CST);
+}
+
+// take the next batch off the queue and persist it; caller holds commit_lock
+// and has made itself the leader, which it stays until this returns
+static void commit_lead(gtfs_t* gtfs) {
+	int max_batch = gtfs->commit_max_batch > 0 ? gtfs->commit_max_batch : 1;
+	if (gtfs->commit_max_wait_us > 0 && (int) gtfs->commit_queue.size() < max_batch) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		long long deadline_us = now.tv_sec * 1000000LL + now.tv_usec + gtfs->commit_max_wait_us;
+		struct timespec deadline;
+		deadline.tv_sec = deadline_us / 1000000;
+		deadline.tv_nsec = (deadline_us % 1000000) * 1000;
+		while ((int) gtfs->commit_queue.size() < max_batch) {
+			if (pthread_cond_timedwait(&gtfs->commit_cond, &gtfs->commit_lock, &deadline) == ETIMEDOUT) break;
+		}
+	}
+	int n = gtfs->commit_queue.size();
+	if (n > max_batch) n = max_batch;
+	vector<commit_req*> batch(gtfs->commit_queue.begin(), gtfs->commit_queue.begin() + n);
+	gtfs->commit_queue.erase(gtfs->commit_queue.begin(), gtfs->commit_queue.begin() + n);
+	pthread_mutex_unlock(&gtfs->commit_lock);
+
+	off_t log_live = flush_batch(gtfs, &batch[0], n);
+	if (gtfs->checkpoint_threshold > 0 && log_live >= gtfs->checkpoint_threshold) checkpoint_request(gtfs);
+
+	// waiting requests live on their syncers' stacks: done is the last touch
+	vector<commit_req*> async;
+	pthread_mutex_lock(&gtfs->commit_lock);
+	for (int i = 0; i < n; i++) {
+		if (batch[i]->complete) async.push_back(batch[i]);
+		batch[i]->done = true;
+	}
+	gtfs->commit_leader_active = false;
+	pthread_cond_broadcast(&gtfs->commit_cond);
+	if (async.empty()) return;
+	pthread_mutex_unlock(&gtfs->commit_lock);
+	for (size_t i = 0; i < async.size(); i++) async[i]->complete(async[i]);
+	pthread_mutex_lock(&gtfs->commit_lock);
+}
+
+// leads the batches nobody waits for, i.e. those of asynchronous syncs only
+static void* commit_thread(void* arg) {
+	gtfs_t* gtfs = (gtfs_t*) arg;
+	pthread_mutex_lock(&gtfs->commit_lock);
+	for (;;) {
+		while (gtfs->commit_queue.empty() || gtfs->commit_leader_active) pthread_cond_wait(&gtfs->commit_cond, &gtfs->commit_lock);
+		gtfs->commit_leader_active = true;
+		commit_lead(gtfs);
+	}
+	return NULL;
+}
+
+// enqueue a record and wait until some leader (possibly this thread) has
+// made it durable; returns 0 on success and -1 on failure. An asynchronous
+// request (with complete set) is only enqueued, and 0 returned.
+static int group_commit(gtfs_t* gtfs, commit_req* req) {
+	pthread_mutex_lock(&gtfs->commit_lock);
+	gtfs->commit_queue.push_back(req);
+	if (req->complete && !gtfs->commit_thread_started) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, commit_thread, gtfs) == 0) {
+			pthread_detach(tid);
+			gtfs->commit_thread_started = true;
+		} else {
+			perror("In group_commit(), when starting committer");
+			gtfs->commit_queue.pop_back();
+			pthread_mutex_unlock(&gtfs->commit_lock);
+			return -1;
+		}
+	}
+	// wake a leader that is waiting for its batch to fill up, or the committer
+	pthread_cond_broadcast(&gtfs->commit_cond);
+	if (req->complete) {
+		pthread_mutex_unlock(&gtfs->commit_lock);
+		return 0;
+	}
+	while (!req->done) {
+		if (gtfs->commit_leader_active) {
+			pthread_cond_wait(&gtfs->commit_cond, &gtfs->commit_lock);
+			continue;
+		}
+		// become the leader for the next batch
+		gtfs->commit_leader_active = true;
+		commit_lead(gtfs);
+	}
+	int ret = req->ret;
+	pthread_mutex_unlock(&gtfs->commit_lock);
+	return ret;
+}
+
+// fill in a record of a file: header, filename, data
+static void log_record_init(commit_req* req, uint8_t type, const string& filename, off_t offset, const char* data, off_t length) {
+	memset(&req->hdr, 0, sizeof(req->hdr));
+	req->hdr.magic = LOG_RECORD_MAGIC;
+	req->hdr.filename_length = filename.size();
+	req->hdr.offset = offset;
+	req->hdr.length = length;
+	req->hdr.type = type;
+	req->hdr.valid = 1;
+	req->payload_crc = crc32c_update(CRC32C_INIT, filename.c_str(), req->hdr.filename_length);
+	req->payload_crc = crc32c_update(req->payload_crc, data, length);
+	req->iov[0].iov_base = &req->hdr;
+	req->iov[0].iov_len = sizeof(req->hdr);
+	req->iov[1].iov_base = (void*) filename.c_str();
+	req->iov[1].iov_len = req->hdr.filename_length;
+	req->iov[2].iov_base = (void*) data;
+	req->iov[2].iov_len = length;
+	req->done = false;
+	req->ret = -1;
+	req->complete = NULL;
+	req->write = NULL;
+	req->callback = NULL;
+	req->callback_arg = NULL;
+}
+
+// add a range of a file to the payload of a LOG_TXN record, continuing crc
+static void txn_range_append(vector<char>& payload, uint32_t& crc, const string& filename, off_t offset, const char* data, off_t length) {
+	txn_range_header th;
+	memset(&th, 0, sizeof(th));
+	th.filename_length = filename.size();
+	th.offset = offset;
+	th.length = length;
+	crc = crc32c_update(crc, &th, sizeof(th));
+	crc = crc32c_update(crc, filename.c_str(), th.filename_length);
+	crc = crc32c_update(crc, data, length);
+	th.valid = 1;
+	payload.insert(payload.end(), (char*) &th, (char*) &th + sizeof(th));
+	payload.insert(payload.end(), filename.begin(), filename.end());
+	payload.insert(payload.end(), data, data + length);
+}
+
+// fill in a LOG_TXN record of count ranges, built by txn_range_append()
+static void log_record_init_txn(commit_req* req, int count, vector<char>& payload, uint32_t crc) {
+	memset(&req->hdr, 0, sizeof(req->hdr));
+	req->hdr.magic = LOG_RECORD_MAGIC;
+	req->hdr.offset = count;
+	req->hdr.length = payload.size();
+	req->hdr.type = LOG_TXN;
+	req->hdr.valid = 1;
+	req->payload_crc = crc;
+	req->iov[0].iov_base = &req->hdr;
+	req->iov[0].iov_len = sizeof(req->hdr);
+	req->iov[1].iov_base = &payload[0];
+	req->iov[1].iov_len = payload.size();
+	req->iov[2].iov_base = NULL;
+	req->iov[2].iov_len = 0;
+	req->done = false;
+	req->ret = -1;
+	req->complete = NULL;
+	req->write = NULL;
+	req->callback = NULL;
+	req->callback_arg = NULL;
+}
+
+// the record of a write: compressed if the write is long enough (and at most
+// INT_MAX bytes) and that makes it smaller. A vectored write of several ranges
+// is a LOG_TXN record of them all, which is never compressed.
+static void log_record_init_write(gtfs_t* gtfs, commit_req* req, write_t* write_id) {
+	if (write_id->ranges.size() > 1) {
+		uint32_t crc = CRC32C_INIT;
+		req->packed.clear();
+		for (size_t i = 0; i < write_id->ranges.size(); i++) {
+			const gtfs_iovec_t& r = write_id->ranges[i];
+			txn_range_append(req->packed, crc, write_id->filename, r.offset, r.buf, r.length);
+		}
+		log_record_init_txn(req, write_id->ranges.size(), req->packed, crc);
+		return;
+	}
+	off_t length = write_id->length;
+	int skip = sizeof(uint64_t);
+	if (gtfs->log_compress_threshold > 0 && length >= gtfs->log_compress_threshold && length > skip && length <= INT_MAX) {
+		req->packed.resize(length);
+		int n = lz_compress(write_id->data, length, &req->packed[skip], length - skip - 1);
+		if (n != -1) {
+			uint64_t raw = length;
+			memcpy(&req->packed[0], &raw, skip);
+			log_record_init(req, LOG_ZWRITE, write_id->filename, write_id->offset, &req->packed[0], skip + n);
+			return;
+		}
+	}
+	log_record_init(req, LOG_WRITE, write_id->filename, write_id->offset, write_id->data, length);
+}
+
+// persist one record of a file through group commit; returns 0 or -1
+static int log_append(gtfs_t* gtfs, uint8_t type, const string& filename, off_t offset, const char* data, off_t length) {
+	commit_req req;
+	log_record_init(&req, type, filename, offset, data, length);
+	return group_commit(gtfs, &req);
+}
+
+// size class of a payload buffer of size bytes
+static int pool_class(size_t size) {
+	int c = 0;
+	while (c < POOL_CLASSES && (size_t) (POOL_MIN_BLOCK << c) < size) c++;
+	return c;
+}
+
+static char* pool_alloc(gtfs_t* gtfs, size_t size) {
+	int c = pool_class(size);
+	if (c == POOL_CLASSES) return new char[size];
+	char* buf = NULL;
+	pthread_mutex_lock(&gtfs->pool_lock);
+	if (!gtfs->buffer_pool[c].empty()) {
+		buf = gtfs->buffer_pool[c].back();
+		gtfs->buffer_pool[c].pop_back();
+	}
+	pthread_mutex_unlock(&gtfs->pool_lock);
+	return buf ? buf : new char[POOL_MIN_BLOCK << c];
+}
+
+static void pool_free(gtfs_t* gtfs, char* buf, size_t size) {
+	int c = pool_class(size);
+	if (c < POOL_CLASSES) {
+		pthread_mutex_lock(&gtfs->pool_lock);
+		bool cached = gtfs->buffer_pool[c].size() < POOL_MAX_CACHED;
+		if (cached) gtfs->buffer_pool[c].push_back(buf);
+		pthread_mutex_unlock(&gtfs->pool_lock);
+		if (cached) return;
+	}
+	delete[] buf;
+}
+
+// a write descriptor with room for length bytes of data, and of undo record
+// unless it is going to be spilled
+static write_t* write_alloc(gtfs_t* gtfs, off_t length, bool spill) {
+	write_t* write_id = NULL;
+	pthread_mutex_lock(&gtfs->pool_lock);
+	if (!gtfs->write_pool.empty()) {
+		write_id = gtfs->write_pool.back();
+		gtfs->write_pool.pop_back();
+	}
+	pthread_mutex_unlock(&gtfs->pool_lock);
+	if (write_id == NULL) write_id = new write_t;
+	write_id->gtfs = gtfs;
+	write_id->length = length;
+	write_id->undo_fd = -1;
+	if (length <= WRITE_INLINE_SIZE) {
+		write_id->data = write_id->inline_buf;
+		write_id->old_data = write_id->inline_buf + WRITE_INLINE_SIZE;
+	} else {
+		write_id->data = pool_alloc(gtfs, length);
+		write_id->old_data = spill ? NULL : pool_alloc(gtfs, length);
+	}
+	return write_id;
+}
+
+static void write_free(write_t* write_id) {
+	gtfs_t* gtfs = write_id->gtfs;
+	if (write_id->data != write_id->inline_buf) {
+		pool_free(gtfs, write_id->data, write_id->length);
+		if (write_id->old_data != NULL) pool_free(gtfs, write_id->old_data, write_id->length);
+	}
+	if (write_id->undo_fd != -1) close(write_id->undo_fd);
+	pthread_mutex_lock(&gtfs->pool_lock);
+	bool cached = gtfs->write_pool.size() < POOL_MAX_CACHED;
+	if (cached) gtfs->write_pool.push_back(write_id);
+	pthread_mutex_unlock(&gtfs->pool_lock);
+	if (!cached) delete write_id;
+}
+
+// copy the bytes a large write replaces (iov, one entry per range) into an
+// unlinked file of the directory, so that the write does not hold a second
+// copy of its size in memory until it is synced; returns the file or -1
+static int undo_spill(gtfs_t* gtfs, vector<struct iovec> iov) {
+	string path = gtfs->dirname + "/.undo.XXXXXX";
+	vector<char> name(path.begin(), path.end());
+	name.push_back('\0');
+	int fd = mkstemp(&name[0]);
+	if (fd == -1) {
+		perror("In undo_spill(), when creating undo file");
+		return -1;
+	}
+	unlink(&name[0]);
+	if (pwritev_full(fd, iov, 0) == -1) {
+		perror("In undo_spill(), when writing undo file");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// read length bytes of a spilled undo record, from pos on, back over the
+// bytes of a range of the write
+static int undo_restore(int fd, char* data, off_t length, off_t pos) {
+	if (pread_full(fd, data, length, pos) != length) {
+		perror("In undo_restore(), when reading undo file");
+		return -1;
+	}
+	return 0;
+}
+
+// apply the pending log records that touch [offset, offset + length) of an
+// mmap-backed file, one page at a time
+static void file_materialize(gtfs_t* gtfs, file_t* fl, off_t offset, off_t length) {
+	if (fl->pending_pages.empty() || length <= 0) return;
+	long page_size = sysconf(_SC_PAGESIZE);
+	long first = offset / page_size, last = (offset + length - 1) / page_size;
+	bool locked = false;
+	log_unpacked unpacked;
+	for (long page = first; page <= last && !fl->pending_pages.empty(); page++) {
+		unordered_map<long, vector<int> >::iterator it = fl->pending_pages.find(page);
+		if (it == fl->pending_pages.end()) continue;
+		if (!locked) {
+			dir_lock(gtfs);
+			locked = true;
+		}
+		long page_start = page * page_size, page_end = page_start + page_size;
+		vector<int>& records = it->second;
+		for (size_t i = 0; i < records.size(); i++) {
+			log_extent_t& e = fl->pending[records[i]];
+			// records a checkpoint applied since the file was opened are in the
+			// file itself now, which the untouched page still shows
+			if (e.log_offset < (off_t) gtfs->shared->base) continue;
+			long start = max(page_start, (long) e.offset);
+			long end = min(page_end, (long) e.offset + e.length);
+			if (extent_read(gtfs, e, start - e.offset, end - start, fl->data + start, unpacked) == -1) perror("In file_materialize(), when reading log record");
+			stats_add(stats_shard(gtfs).replay_records, 1);
+		}
+		fl->pending_pages.erase(it);
+	}
+	if (fl->pending_pages.empty()) fl->pending.clear();
+	if (locked) dir_unlock(gtfs);
+}
+
+// add [start, end) to the dirty bytes of a file, merging it with the extents
+// it overlaps or touches
+static void file_add_extent(map<off_t, off_t>& extents, off_t start, off_t end) {
+	map<off_t, off_t>::iterator it = extents.upper_bound(start);
+	if (it != extents.begin()) {
+		map<off_t, off_t>::iterator prev = it;
+		--prev;
+		if (prev->second >= start) it = prev;
+	}
+	while (it != extents.end() && it->first <= end) {
+		start = min(start, it->first);
+		end = max(end, it->second);
+		extents.erase(it++);
+	}
+	extents[start] = end;
+}
+
+// note a write of [offset, offset + length) to the in-memory data of a file:
+// pending counts the writes on its pages still to be synced (1 for a new
+// write, -1 once it is synced or aborted). The bytes of a synced write become
+// dirty: a flush writes only those, since the rest of a page may be stale
+// next to what other processes put in the file. Caller holds the file's lock
+static void file_mark_dirty(file_t* fl, off_t offset, off_t length, int pending, bool synced) {
+	if (length <= 0) return;
+	long page_size = sysconf(_SC_PAGESIZE);
+	for (long page = offset / page_size; page <= (offset + length - 1) / page_size; page++) {
+		int& count = fl->unsynced_pages[page];
+		count += pending;
+		if (count <= 0) fl->unsynced_pages.erase(page);
+	}
+	int& ends = fl->unsynced_ends[offset + length];
+	ends += pending;
+	if (ends <= 0) fl->unsynced_ends.erase(offset + length);
+	if (synced) {
+		file_add_extent(fl->dirty_extents, offset, offset + length);
+		fl->synced_length = max(fl->synced_length, offset + length);
+	}
+}
+
+// The replayed image of a file, shared by the processes opening it: a SysV
+// shared memory segment keyed by the file, holding this header and then the
+// file's data. The image is the file with every log record of it before
+// applied, so an open only replays the records after that. It is read and
+// brought up to date under the directory lock.
+struct file_cache {
+	uint32_t magic; // FILE_CACHE_MAGIC once the image is complete
+	dev_t file_dev; // the file owning the segment, set by the first open; ftok()
+	ino_t file_ino; // keeps only part of these, so other files may share the key
+	dev_t log_dev; // the log (and incarnation of the control block) it was replayed from
+	ino_t log_ino;
+	uint64_t epoch;
+	char filename[MAX_FILENAME_LEN + 1];
+	off_t file_length;
+	uint64_t applied; // version of the image: a log position
+};
+
+// whether the cache segment belongs to the file with statbuf, claiming it if
+// it is new (zeroed)
+static bool file_cache_owned(file_cache* fc, const struct stat& statbuf) {
+	ino_t none = 0;
+	if (__atomic_compare_exchange_n(&fc->file_ino, &none, statbuf.st_ino, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) fc->file_dev = statbuf.st_dev;
+	return fc->file_ino == statbuf.st_ino && fc->file_dev == statbuf.st_dev;
+}
+
+// attach the cache segment of the file at path (with statbuf), creating it
+// (invalid) if it does not exist or has another length; returns NULL if it is
+// unavailable or belongs to another file, whose cache is left alone
+static file_cache* file_cache_attach(const string& path, const struct stat& statbuf, const string& filename, off_t file_length) {
+	key_t key = ftok(path.c_str(), FILE_CACHE_PROJ);
+	if (key == -1) return NULL;
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int shm_id = shmget(key, sizeof(file_cache) + file_length, 0666 | IPC_CREAT);
+		// the segment of a shorter version of the file, or of another file
+		bool shorter = shm_id == -1 && errno == EINVAL;
+		if (shorter && (shm_id = shmget(key, 0, 0666)) == -1) return NULL;
+		file_cache* fc = shm_id == -1 ? (file_cache*) -1 : (file_cache*) shmat(shm_id, NULL, 0);
+		if (fc == (file_cache*) -1) {
+			perror("In file_cache_attach(), when attaching file cache");
+			return NULL;
+		}
+		if (!file_cache_owned(fc, statbuf) || (fc->magic == FILE_CACHE_MAGIC && filename != fc->filename)) {
+			shmdt(fc);
+			return NULL;
+		}
+		if (!shorter && (fc->magic != FILE_CACHE_MAGIC || fc->file_length == file_length)) return fc;
+		shmdt(fc);
+		// the segment of a shorter or longer version of the file
+		shmctl(shm_id, IPC_RMID, NULL);
+	}
+	return NULL;
+}
+
+// forget the cached image of a file that is about to be removed, unless the
+// segment under its key is another file's
+static void file_cache_drop(const string& path) {
+	struct stat statbuf;
+	key_t key = ftok(path.c_str(), FILE_CACHE_PROJ);
+	int shm_id = key == -1 || stat(path.c_str(), &statbuf) == -1 ? -1 : shmget(key, 0, 0666);
+	file_cache* fc = shm_id == -1 ? (file_cache*) -1 : (file_cache*) shmat(shm_id, NULL, 0);
+	if (fc == (file_cache*) -1) return;
+	bool owned = fc->file_ino == statbuf.st_ino && fc->file_dev == statbuf.st_dev;
+	shmdt(fc);
+	if (owned) shmctl(shm_id, IPC_RMID, NULL);
+}
+
+// whether the cached image can be brought up to date from the log: it comes
+// from this log, nothing it lacks was checkpointed, and the file was not
+// removed since; caller holds the semaphore
+static bool file_cache_valid(gtfs_t* gtfs, file_cache* fc, const string& filename, off_t file_length) {
+	gtfs_shared* sh = gtfs->shared;
+	if (fc->magic != FILE_CACHE_MAGIC || filename != fc->filename || fc->file_length != file_length) return false;
+	if (fc->log_dev != sh->log_dev || fc->log_ino != sh->log_ino || fc->epoch != sh->epoch) return false;
+	if (fc->applied < sh->base) return false;
+	unordered_map<string, off_t>::iterator d = gtfs->log_dropped.find(filename);
+	return d == gtfs->log_dropped.end() || (uint64_t) d->second <= fc->applied;
 }
 
-gtfs_t* gtfs_init(string directory, int verbose_flag) {
+gtfs_t* gtfs_init(string directory, int verbose_flag, int data_mode, int recovery_threads) {
 	do_verbose = verbose_flag;
 	gtfs_t *gtfs = NULL;
 	VERBOSE_PRINT(do_verbose, "Initializing GTFileSystem inside directory " << directory << "\n");
 	//TODO: Any additional initializations and checks
 	// obtain the shared memory id and semaphore id of metadata
-	key_t exist_key = ftok((directory + "/log").c_str(), 1);
-	//printf("exist_key: %d\n", exist_key);
 	gtfs = new gtfs_t;
 	gtfs->dirname = string(directory);
 	key_t dir_key = ftok(directory.c_str(), 1);
-	int sem_id = semget(dir_key, 1, 0666 | IPC_CREAT);
+	// whoever creates the semaphore initializes it; this does not depend on the
+	// log file, which survives reboots (and older versions) while semaphores do not
+	int sem_id = semget(dir_key, 1, 0666 | IPC_CREAT | IPC_EXCL);
+	bool sem_created = sem_id != -1;
+	if (!sem_created) sem_id = semget(dir_key, 1, 0666);
 	short one = 1;
-	int shm_id = shmget(dir_key, (MAX_FILENAME_LEN + sizeof(int))*MAX_NUM_FILES_PER_DIR, 0666 | IPC_CREAT);
-	// get or create log file for current directory and write the initial tail position
+	// the append gate is a second semaphore, taken once by every appender
+	key_t gate_key = ftok(directory.c_str(), 2);
+	int gate_id = semget(gate_key, 1, 0666 | IPC_CREAT | IPC_EXCL);
+	bool gate_created = gate_id != -1;
+	if (!gate_created) gate_id = semget(gate_key, 1, 0666);
+	int shm_id = shmget(dir_key, sizeof(gtfs_shared), 0666 | IPC_CREAT);
+	if (shm_id == -1 && errno == EINVAL) {
+		// segment of an older version, too small for the control block
+		shmctl(shmget(dir_key, 0, 0666), IPC_RMID, NULL);
+		shm_id = shmget(dir_key, sizeof(gtfs_shared), 0666 | IPC_CREAT);
+	}
+	gtfs_shared* shared = shm_id == -1 ? (gtfs_shared*) -1 : (gtfs_shared*) shmat(shm_id, NULL, 0);
+	if (sem_id == -1 || gate_id == -1 || shared == (gtfs_shared*) -1) {
+		perror("In gtfs_init(), when getting shared memory or semaphores");
+		delete gtfs;
+		return NULL;
+	}
+	// get or create log file for current directory; it is written with
+	// pwrite() at offsets reserved in the shared control block
 	// we keep the log file open until a clean() operation happens
-	define_sem_op(&op1, &op2);
-	int log_fd = open((directory + "/log").c_str(), O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR);
+	string logpath = directory + "/log";
+	int log_fd = open(logpath.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
 	//printf("log_fd: %d\n", log_fd);
-	// if the log file is not created, then initialize the log tail to zero
-	if (exist_key == -1) {
-		stringstream ss;
+	if (sem_created) {
 		if (semctl(sem_id, 0, SETALL, &one) == -1) perror("In semctl()");
 	}
+	if (gate_created) {
+		if (semctl(gate_id, 0, SETVAL, APPEND_GATE_MAX) == -1) perror("In semctl()");
+	}
 
 	//cout << "sem_id: " << sem_id << ", shm_id: " << shm_id << endl;
 	gtfs->sem_id = sem_id;
 	gtfs->shm_id = shm_id;
+	gtfs->gate_id = gate_id;
+	gtfs->shared = shared;
+	gtfs->stats = new gtfs_stats_shard[GTFS_STATS_SHARDS]();
+	pthread_mutex_init(&gtfs->stats_lock, NULL);
+	pthread_cond_init(&gtfs->stats_cond, NULL);
+	gtfs->stats_dump_interval_ms = 0;
+	gtfs->stats_dump_started = false;
+	pthread_mutex_init(&gtfs->dir_mutex, NULL);
+	pthread_cond_init(&gtfs->dir_cond, NULL);
+	gtfs->dir_owned = false;
+	gtfs->dir_sem_held = false;
+	gtfs->dir_waiters = 0;
+	gtfs->dir_handoffs = 0;
 	gtfs->log_fd = log_fd;
+	gtfs->segment_size = DEFAULT_LOG_SEGMENT_SIZE;
+	pthread_mutex_init(&gtfs->segment_lock, NULL);
+	gtfs->commit_max_batch = DEFAULT_COMMIT_MAX_BATCH;
+	gtfs->commit_max_wait_us = DEFAULT_COMMIT_MAX_WAIT_US;
+	pthread_mutex_init(&gtfs->commit_lock, NULL);
+	pthread_cond_init(&gtfs->commit_cond, NULL);
+	gtfs->commit_leader_active = false;
+	gtfs->commit_thread_started = false;
+	gtfs->data_mode = data_mode;
+	gtfs->recovery_threads = recovery_threads;
+	gtfs->file_prealloc = DEFAULT_FILE_PREALLOC;
+	gtfs->checkpoint_threshold = DEFAULT_CHECKPOINT_THRESHOLD;
+	gtfs->undo_spill_threshold = DEFAULT_UNDO_SPILL_THRESHOLD;
+	gtfs->log_compress_threshold = DEFAULT_LOG_COMPRESS_THRESHOLD;
+	gtfs->file_cache = DEFAULT_FILE_CACHE;
+	pthread_mutex_init(&gtfs->checkpoint_lock, NULL);
+	pthread_cond_init(&gtfs->checkpoint_cond, NULL);
+	gtfs->checkpoint_requested = false;
+	gtfs->checkpoint_started = false;
+	pthread_mutex_init(&gtfs->pool_lock, NULL);
+	// load the log index, rebuilding it if it is missing or stale
+	gtfs->idx_fd = open((directory + "/log.idx").c_str(), O_CREAT | O_RDWR | O_APPEND, S_IRUSR | S_IWUSR);
+	if (gtfs->idx_fd == -1) perror("In gtfs_init(), when opening log index");
+	gtfs->idx_generation = 0;
+	gtfs->idx_pos = 0;
+	gtfs->log_indexed = 0;
+	dir_lock(gtfs);
+	struct stat statbuf, path_stat;
+	fstat(gtfs->log_fd, &statbuf);
+	if (stat(logpath.c_str(), &path_stat) == 0 && (path_stat.st_ino != statbuf.st_ino || path_stat.st_dev != statbuf.st_dev)) {
+		// another process migrated the log after we opened it
+		close(gtfs->log_fd);
+		gtfs->log_fd = open(logpath.c_str(), O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+		fstat(gtfs->log_fd, &statbuf);
+	}
+	if (shared->magic != SHARED_MAGIC || shared->log_ino != statbuf.st_ino || shared->log_dev != statbuf.st_dev) {
+		// first user of the directory since boot: rebuild the control block
+		dir_sem_op(gate_id, -APPEND_GATE_MAX);
+		// a log written by an older version (with no header, or with the records
+		// after it) is converted to segments first
+		log_header_v1 lh;
+		ssize_t nr = pread(gtfs->log_fd, &lh, sizeof(lh), 0);
+		if ((nr >= (ssize_t) sizeof(lh.magic) && lh.magic != LOG_MAGIC) || (nr == sizeof(lh) && lh.version < LOG_FORMAT_VERSION)) {
+			gtfs->segment_size = DEFAULT_LOG_SEGMENT_SIZE;
+			if (log_migrate(gtfs, statbuf.st_size) == 0) index_reset(gtfs);
+		}
+		shared_recover(gtfs);
+		dir_sem_op(gate_id, APPEND_GATE_MAX);
+	} else {
+		gtfs->segment_size = shared->segment_size;
+		// regions of appenders that died are padded now: otherwise a record we
+		// do not see could still show up after the next recovery
+		for (;;) {
+			uint64_t pub = __atomic_load_n(&shared->published, __ATOMIC_SEQ_CST);
+			if (pub >= __atomic_load_n(&shared->log_tail, __ATOMIC_SEQ_CST)) break;
+			shared_rescue(gtfs, pub);
+			if (__atomic_load_n(&shared->published, __ATOMIC_SEQ_CST) == pub) break;
+		}
+		index_refresh(gtfs);
+	}
+	dir_unlock(gtfs);
 
 	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns non NULL.
 	return gtfs;
@@ -59,51 +2406,17 @@ int gtfs_clean(gtfs_t *gtfs) {
 		return ret;
 	}
 	//TODO: Any additional initializations and checks
-	semop(gtfs->sem_id, &op1, 1);
-	lseek(gtfs->log_fd, 0, SEEK_SET);
+	uint64_t start = stats_now();
 	// persist the changes in log file to actual files under this directory
-	int filename_length;
-	while (read(gtfs->log_fd, &filename_length, sizeof(int)) > 0) {
-		char* filename = new char[MAX_FILENAME_LEN];
-		char* file_path = new char[(gtfs->dirname).size() + MAX_FILENAME_LEN + 1];
-		read(gtfs->log_fd, filename, filename_length);
-		strcpy(file_path, (gtfs->dirname + "/").c_str());
-		strcat(file_path, filename); // file_path: "dirname/filename"
-		//cout << "In gtfs_clean(), file path: " << file_path << endl;
-		int offset, data_length;
-		read(gtfs->log_fd, &offset, sizeof(int));
-		read(gtfs->log_fd, &data_length, sizeof(int));
-		char* data = new char[data_length];
-		char valid;
-		read(gtfs->log_fd, data, data_length);
-		read(gtfs->log_fd, &valid, 1);
-		//cout << "offset: " << offset << ", length: " << data_length << ", data: " << data << ", valid: " << (int) valid << endl;
-		if (valid == 1) {
-			struct stat statbuf;
-			stat(file_path, &statbuf);
-			int file_len = statbuf.st_size;
-			int fd;
-			string file_path_str(file_path);
-			fd = open(file_path, O_RDWR);
-			//cout << "fd: " << fd << endl;
-			char* mapped_data = (char*) mmap(NULL, file_len, PROT_WRITE, MAP_SHARED, fd, 0);
-			memcpy(mapped_data + offset, data, data_length);
-			fsync(fd);
-			munmap(mapped_data, file_len);
-			close(fd);
-		}
-	}
-	semop(gtfs->sem_id, &op2, 1);
-	stringstream ss;
-	ss << "truncate --size=0" << " " << gtfs->dirname << "/log";
-	system(ss.str().c_str());
+	if (checkpoint(gtfs, true) == -1) return ret;
 
+	stats_op(gtfs, GTFS_OP_CLEAN, start);
 	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns 0.
 	ret = 0;
 	return ret;
 }
 
-file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length) {
+file_t* gtfs_open_file(gtfs_t* gtfs, string filename, off_t file_length) {
 	file_t *fl = NULL;
 	if (gtfs) {
 		VERBOSE_PRINT(do_verbose, "Opening file " << filename << " inside directory " << gtfs->dirname << "\n");
@@ -112,6 +2425,7 @@ file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length) {
 		return NULL;
 	}
 	//TODO: Any additional initializations and checks
+	uint64_t start = stats_now();
 	// retieve (or create) the target file
 	stringstream ss;
 	ss << gtfs->dirname << "/" << filename;
@@ -124,56 +2438,121 @@ file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length) {
 		return fl;
 	}
 	lockf(fd, F_TLOCK, 0); // if another process acquire the lock, return an error
+	if (file_length < 0) {
+		VERBOSE_PRINT(do_verbose, "Negative file length\n");
+		close(fd);
+		return fl;
+	}
 
-	// fail the operation if file_length arg is smaller than the actual file size
-	// adjust file size if needed if file_length arg is greater than the actual file size
+	// the file is read (or mapped) and its log records applied under the
+	// directory lock, so that no checkpoint moves records from the log into it
+	// meanwhile
+	dir_lock(gtfs);
+	// every record before published is in the index once it is refreshed
+	uint64_t published = __atomic_load_n(&gtfs->shared->published, __ATOMIC_SEQ_CST);
+	index_refresh(gtfs);
+	// the file keeps the length it has, on disk or through writes past its end
+	// still in the log, if that is more than file_length
 	struct stat statbuf;
-	stat(pathname, &statbuf);
-	if (file_length < statbuf.st_size) {
-		perror("Cannot truncate file into smaller file\n");
-		return fl;
+	if (fstat(fd, &statbuf) == -1) statbuf.st_size = 0;
+	file_length = max(file_length, (off_t) statbuf.st_size);
+	unordered_map<string, vector<log_extent_t> >::iterator it = gtfs->log_index.find(filename);
+	if (it != gtfs->log_index.end()) {
+		for (size_t i = 0; i < it->second.size(); i++) file_length = max(file_length, it->second[i].offset + it->second[i].length);
 	}
-	else if (file_length > statbuf.st_size) {
-		stringstream cmd_ss;
-		cmd_ss << "truncate --size=" << file_length << " " << filename_complete;
-		system(cmd_ss.str().c_str());
+	if (file_extend(gtfs, fd, statbuf.st_size, file_length) == -1) {
+		dir_unlock(gtfs);
+		close(fd);
+		return fl;
 	}
+	if (gtfs->log_dropped.count(filename)) file_fd_drop(gtfs, filename);
+	unordered_map<string, file_fd_t>::iterator cached = gtfs->file_fds.find(filename);
+	if (cached != gtfs->file_fds.end()) cached->second.size = file_length;
 
 	fl = new file_t;
 	fl->filename = string(filename);
 	fl->fd = fd;
 	fl->file_length = file_length;
-	fl->data = new char[file_length];
-	read(fd, fl->data, file_length);
+	fl->synced_length = file_length;
+	fl->data_mode = gtfs->data_mode;
+	pthread_mutex_init(&fl->lock, NULL);
+	if (fl->data_mode == GTFS_DATA_MMAP && file_length > 0) {
+		// pages are read from the file only when touched, and modified copy-on-write
+		fl->data = (char*) mmap(NULL, file_length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (fl->data == MAP_FAILED) {
+			perror("In mmap() in gtfs_open_file");
+			fl->data_mode = GTFS_DATA_COPY;
+		}
+	} else {
+		fl->data_mode = GTFS_DATA_COPY;
+	}
+	fl->data_capacity = file_length;
+	if (fl->data_mode == GTFS_DATA_COPY) fl->data = new char[file_length];
 
-	// write a record into shared memory
-	// apply the changes in log file to in-memory version of data
-	semop(gtfs->sem_id, &op1, 1);
-	int filename_length;
-	off_t start_pos = lseek(gtfs->log_fd, 0, SEEK_SET);
-	if (start_pos == -1) perror("In lseek() in gtfs_open_file");
-	while (read(gtfs->log_fd, &filename_length, sizeof(int)) > 0) {
-		//cout << "filename_length: " << filename_length << endl;
-		char fname[MAX_FILENAME_LEN];
-		ssize_t nr = read(gtfs->log_fd, fname, filename_length);
-		if (nr == -1) perror("In read() (reading log file) in gtfs_open_file");
-		//cout << "fl->filename: " << fl->filename << ", fname: " << string(fname) << endl;
-		int offset, data_length;
-		read(gtfs->log_fd, &offset, sizeof(int));
-		read(gtfs->log_fd, &data_length, sizeof(int));
-		char* data = new char[data_length];
-		char valid;
-		read(gtfs->log_fd, data, data_length);
-		//cout << "offset: " << offset << ", length: " << data_length << ", data: " << data << endl;
-		read(gtfs->log_fd, &valid, 1);
-		//cout << "valid: " << (int) valid << endl;
-		if (strcmp(fname, filename.c_str()) == 0 && valid == 1) {
-			//cout << "found log related to " << fname << endl;
-			memcpy(fl->data + offset, data, data_length);
+	// apply the changes in log file to in-memory version of data, reading only
+	// the records the log index lists for this file
+	fl->shared_file = shared_file_find(gtfs->shared, filename, true);
+	if (fl->shared_file != -1) __atomic_add_fetch(&gtfs->shared->files[fl->shared_file].open_count, 1, __ATOMIC_SEQ_CST);
+	// whatever the file held before its last remove is void; if the remove
+	// completed, this only overwrites zeros
+	if (gtfs->log_dropped.count(filename)) file_clear_dropped(gtfs, filename, false);
+	// with the file cache, the records are replayed into the shared image, from
+	// where it was left (or from scratch), and the result is copied
+	file_cache* fc = NULL;
+	if (fl->data_mode == GTFS_DATA_COPY && gtfs->file_cache) fc = file_cache_attach(filename_complete, statbuf, filename, file_length);
+	char* image = fc ? (char*) (fc + 1) : fl->data;
+	uint64_t replay_from = 0;
+	if (fc && file_cache_valid(gtfs, fc, filename, file_length)) {
+		replay_from = fc->applied;
+	} else {
+		// if we die halfway, the next open starts over
+		if (fc) fc->magic = 0;
+		if (fl->data_mode == GTFS_DATA_COPY) {
+			ssize_t nr = pread_full(fd, image, file_length, 0);
+			if (nr == -1) perror("In pread() in gtfs_open_file");
+			// past the end of the file (e.g. it could not be extended) reads as zeros
+			memset(image + max(nr, (ssize_t) 0), 0, file_length - max(nr, (ssize_t) 0));
 		}
 	}
-	semop(gtfs->sem_id, &op2, 1);
+	it = gtfs->log_index.find(filename);
+	if (it != gtfs->log_index.end()) {
+		vector<log_extent_t>& extents = it->second;
+		long page_size = sysconf(_SC_PAGESIZE);
+		log_unpacked unpacked;
+		for (size_t i = 0; i < extents.size(); i++) {
+			log_extent_t& e = extents[i];
+			if (e.offset + e.length > file_length || e.length == 0) continue;
+			// records from published on may have been replayed into the image
+			// already; replaying them again in log order gives the same result
+			if ((uint64_t) e.log_offset < replay_from) continue;
+			if (fl->data_mode == GTFS_DATA_MMAP) {
+				// defer the record to the first access of the pages it covers
+				int idx = fl->pending.size();
+				fl->pending.push_back(e);
+				for (long page = e.offset / page_size; page <= (e.offset + e.length - 1) / page_size; page++) {
+					fl->pending_pages[page].push_back(idx);
+				}
+				continue;
+			}
+			if (extent_read(gtfs, e, 0, e.length, image + e.offset, unpacked) == -1) perror("In pread() (reading log file) in gtfs_open_file");
+			stats_add(stats_shard(gtfs).replay_records, 1);
+		}
+	}
+	if (fc) {
+		fc->log_dev = gtfs->shared->log_dev;
+		fc->log_ino = gtfs->shared->log_ino;
+		fc->epoch = gtfs->shared->epoch;
+		strncpy(fc->filename, filename.c_str(), MAX_FILENAME_LEN);
+		fc->filename[MAX_FILENAME_LEN] = '\0';
+		fc->file_length = file_length;
+		fc->applied = published;
+		fc->magic = FILE_CACHE_MAGIC;
+		memcpy(fl->data, image, file_length);
+		shmdt(fc);
+	}
+	dir_unlock(gtfs);
 
+	stats_op(gtfs, GTFS_OP_OPEN, start);
 	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns non NULL.
 	return fl;
 }
@@ -190,9 +2569,22 @@ int gtfs_close_file(gtfs_t* gtfs, file_t* fl) {
 	lockf(fl->fd, F_ULOCK, 0);
 	ret = close(fl->fd);
 	if (ret == -1) perror("In close() in gtfs_close_file");
-	semop(gtfs->sem_id, &op1, 1);
-	int ret2 = close(gtfs->log_fd);
-	semop(gtfs->sem_id, &op2, 1);
+	// the log file stays open: it belongs to gtfs and is shared by every file
+	// (and by the group commit leader) until the next clean() operation
+	pthread_mutex_lock(&fl->lock);
+	if (fl->data_mode == GTFS_DATA_MMAP) {
+		if (munmap(fl->data, fl->file_length) == -1) perror("In munmap() in gtfs_close_file");
+	} else {
+		delete[] fl->data;
+	}
+	fl->data = NULL;
+	fl->pending.clear();
+	fl->pending_pages.clear();
+	fl->dirty_extents.clear();
+	fl->unsynced_pages.clear();
+	fl->unsynced_ends.clear();
+	pthread_mutex_unlock(&fl->lock);
+	if (fl->shared_file != -1) __atomic_sub_fetch(&gtfs->shared->files[fl->shared_file].open_count, 1, __ATOMIC_SEQ_CST);
 	
 	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns 0.
 	return ret;
@@ -207,58 +2599,37 @@ int gtfs_remove_file(gtfs_t* gtfs, file_t* fl) {
 	    return ret;
 	}
 	//TODO: Any additional initializations and checks
+	uint64_t start = stats_now();
 	// acquire for semaphore so that the operation cannot be performed when the file is open
 	stringstream ss1;
 	ss1 << gtfs->dirname << "/" << fl->filename;
 	string filepath = ss1.str();
-	semop(gtfs->sem_id, &op1, 1);
+	// append a tombstone; once it is durable, replay, indexing and checkpoints
+	// ignore every earlier record of the file, so the file goes after it
+	if (log_append(gtfs, LOG_DROP, fl->filename, 0, NULL, 0) == -1) {
+		perror("In gtfs_remove_file(), when appending tombstone");
+		return ret;
+	}
+	dir_lock(gtfs);
+	file_cache_drop(filepath);
+	file_fd_drop(gtfs, fl->filename);
 	if (remove(filepath.c_str()) == -1) perror("In gtfs_remove_file");
-	// traverse the log file to invalidate all the log records related to this file
-	string logpath = gtfs->dirname + "/log";
-	int log_fd = open(logpath.c_str(), O_RDWR);
-	struct stat statbuf;
-	stat(logpath.c_str(), &statbuf);
-	int log_length = statbuf.st_size;
-	char* log_data = (char*) mmap(NULL, log_length, PROT_WRITE, MAP_SHARED, log_fd, 0);
-	if (log_data == MAP_FAILED) perror("In gtfs_remove_file(), when mapping log data");
-	int pos = 0;
-	while (pos < log_length) {
-		int filename_length, offset, data_length;
-		//cout << "pos: " << pos << endl;
-		memcpy(&filename_length, log_data + pos, sizeof(int));
-		pos += sizeof(int);
-		char* fname = new char[MAX_FILENAME_LEN];
-		memcpy(fname, log_data + pos, filename_length);
-		pos += filename_length;
-		memcpy(&offset, log_data + pos, sizeof(int));
-		pos += sizeof(int);
-		memcpy(&data_length, log_data + pos, sizeof(int));
-		pos += sizeof(int);
-		char* data = new char[data_length];
-		char valid;
-		memcpy(data, log_data + pos, data_length);
-		pos += data_length;
-		memcpy(&valid, log_data + pos, 1);
-		//cout << "filename: " << fname << ", offset: " << offset << ", length: " << data_length << ", data: " << data << ", valid: " << (int) valid << endl;
-		if ((fl->filename).compare(string(fname)) == 0 && valid == 1) {
-			char invalid = 0;
-			memcpy(log_data + pos, &invalid, 1);
-		}
-		pos += 1;
-	}
-	fsync(log_fd);
-	if (munmap(log_data, log_length) == -1) perror("In gtfs_remove_file(), when unmapping log data");
-	close(log_fd);
+	int f = shared_file_find(gtfs->shared, fl->filename, false);
+	if (f != -1) {
+		gtfs->shared->files[f].record_count = 0;
+		if (gtfs->shared->files[f].open_count <= 0) gtfs->shared->files[f].filename[0] = '\0';
+	}
 	delete fl;
-	semop(gtfs->sem_id, &op2, 1);
+	dir_unlock(gtfs);
 
+	stats_op(gtfs, GTFS_OP_REMOVE, start);
 	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns 0.
 	ret = 0;
 	return ret;	
 	
 }
 
-char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length) {
+char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, off_t offset, off_t length) {
 	char* ret_data = NULL;
 	if (gtfs and fl) {
 		VERBOSE_PRINT(do_verbose, "Reading " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
@@ -267,45 +2638,305 @@ char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length) {
 		return NULL;
 	}
 	//TODO: Any additional initializations and checks
+	uint64_t start = stats_now();
+	pthread_mutex_lock(&fl->lock);
+	file_materialize(gtfs, fl, offset, length);
 	ret_data = new char[length];
 	memcpy(ret_data, fl->data + offset, length);
+	pthread_mutex_unlock(&fl->lock);
 	//cout << "ret_data: " << ret_data << endl;
 	
+	stats_op(gtfs, GTFS_OP_READ, start);
 	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns pointer to data read.
 	return ret_data;	
 }
 
-write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const char* data) {
-	write_t *write_id = NULL;
+gtfs_view_t gtfs_read_view(gtfs_t* gtfs, file_t* fl, off_t offset, off_t length) {
+	gtfs_view_t view;
+	view.data = NULL;
+	view.length = 0;
 	if (gtfs and fl) {
-		VERBOSE_PRINT(do_verbose, "Writting " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
+		VERBOSE_PRINT(do_verbose, "Viewing " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
 	} else {
 		VERBOSE_PRINT(do_verbose, "GTFileSystem or file is not existed\n");
-		return NULL;
+		return view;
 	}
-	//TODO: Any additional initializations and checks
-	write_id = new write_t;
-	if (write_id == 0) perror("In initialization of write_id");
+	if (fl->data == NULL || offset < 0 || length < 0 || length > fl->file_length - offset) {
+		VERBOSE_PRINT(do_verbose, "Range is out of file bounds\n");
+		return view;
+	}
+	uint64_t start = stats_now();
+	pthread_mutex_lock(&fl->lock);
+	file_materialize(gtfs, fl, offset, length);
+	pthread_mutex_unlock(&fl->lock);
+	view.data = fl->data + offset;
+	view.length = length;
+
+	stats_op(gtfs, GTFS_OP_READ, start);
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns a non NULL view.
+	return view;
+}
+
+ssize_t gtfs_read_file_into(gtfs_t* gtfs, file_t* fl, off_t offset, off_t length, char* buf) {
+	ssize_t ret = -1;
+	if (gtfs and fl and buf) {
+		VERBOSE_PRINT(do_verbose, "Reading " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "GTFileSystem, file or buffer is not existed\n");
+		return ret;
+	}
+	if (fl->data == NULL || offset < 0 || length < 0 || length > fl->file_length - offset) {
+		VERBOSE_PRINT(do_verbose, "Range is out of file bounds\n");
+		return ret;
+	}
+	uint64_t start = stats_now();
+	pthread_mutex_lock(&fl->lock);
+	file_materialize(gtfs, fl, offset, length);
+	memcpy(buf, fl->data + offset, length);
+	pthread_mutex_unlock(&fl->lock);
+	ret = length;
+
+	stats_op(gtfs, GTFS_OP_READ, start);
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns number of bytes read.
+	return ret;
+}
+
+ssize_t gtfs_readv_file(gtfs_t* gtfs, file_t* fl, const gtfs_iovec_t* iov, int iovcnt) {
+	ssize_t ret = -1;
+	if (gtfs and fl and (iov or iovcnt == 0)) {
+		VERBOSE_PRINT(do_verbose, "Reading " << iovcnt << " ranges inside file " << fl->filename << "\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "GTFileSystem, file or ranges are not existed\n");
+		return ret;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (fl->data == NULL || iov[i].offset < 0 || iov[i].length < 0 || iov[i].length > fl->file_length - iov[i].offset || (iov[i].buf == NULL && iov[i].length > 0)) {
+			VERBOSE_PRINT(do_verbose, "Range is out of file bounds\n");
+			return ret;
+		}
+	}
+	uint64_t start = stats_now();
+	ret = 0;
+	pthread_mutex_lock(&fl->lock);
+	for (int i = 0; i < iovcnt; i++) {
+		file_materialize(gtfs, fl, iov[i].offset, iov[i].length);
+		memcpy(iov[i].buf, fl->data + iov[i].offset, iov[i].length);
+		ret += iov[i].length;
+	}
+	pthread_mutex_unlock(&fl->lock);
+
+	stats_op(gtfs, GTFS_OP_READ, start);
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns number of bytes read.
+	return ret;
+}
+
+// grow the in-memory data of a file to length bytes, zero-filled; an mmap-backed
+// file is extended on disk first, so that its mapping can cover the new
+// bytes. Caller holds the file's lock; returns 0 or -1.
+static int file_grow(gtfs_t* gtfs, file_t* fl, off_t length) {
+	if (fl->data_mode == GTFS_DATA_MMAP) {
+		if (file_extend(gtfs, fl->fd, fl->file_length, length) == -1) return -1;
+		char* data = (char*) mremap(fl->data, fl->file_length, length, MREMAP_MAYMOVE);
+		if (data == MAP_FAILED) {
+			perror("In file_grow(), when remapping file");
+			return -1;
+		}
+		fl->data = data;
+	} else {
+		// the buffer at least doubles, so that appending to a file does not
+		// copy all of it every time
+		if (length > fl->data_capacity) {
+			off_t capacity = max(length, fl->data_capacity + min(fl->data_capacity, (off_t) FILE_GROW_MAX_STEP));
+			char* data = new char[capacity];
+			memcpy(data, fl->data, fl->file_length);
+			delete[] fl->data;
+			fl->data = data;
+			fl->data_capacity = capacity;
+		}
+		memset(fl->data + fl->file_length, 0, length - fl->file_length);
+	}
+	fl->file_length = length;
+	return 0;
+}
+
+// after an abort, cut the file back to the end of the writes still in it,
+// synced or not. In mmap mode the file itself was extended for the write, and
+// is truncated back unless it grew further since. Caller holds the file's lock
+static void file_shrink(gtfs_t* gtfs, file_t* fl) {
+	off_t length = fl->synced_length;
+	if (!fl->unsynced_ends.empty()) length = max(length, fl->unsynced_ends.rbegin()->first);
+	if (fl->data == NULL || length >= fl->file_length) return;
+	if (fl->data_mode == GTFS_DATA_MMAP) {
+		// no checkpoint writes to the file meanwhile
+		dir_lock(gtfs);
+		struct stat statbuf;
+		if (fstat(fl->fd, &statbuf) == 0 && statbuf.st_size == fl->file_length && ftruncate(fl->fd, length) == -1) perror("In file_shrink(), when truncating file");
+		dir_unlock(gtfs);
+		char* data = (char*) mremap(fl->data, fl->file_length, length, 0);
+		if (data == MAP_FAILED) {
+			perror("In file_shrink(), when remapping file");
+			return;
+		}
+		fl->data = data;
+	}
+	fl->file_length = length;
+}
+
+// a write of the ranges: copy them and apply them to the in-memory data of
+// the file in order, growing it if they go past its end, and keep what they
+// replace as the undo record; returns NULL if the file cannot grow
+static write_t* write_start(gtfs_t* gtfs, file_t* fl, const gtfs_iovec_t* iov, int iovcnt) {
+	off_t length = 0, end = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		length += iov[i].length;
+		end = max(end, iov[i].offset + iov[i].length);
+	}
+	bool spill = gtfs->undo_spill_threshold > 0 && length > gtfs->undo_spill_threshold;
+	write_t* write_id = write_alloc(gtfs, length, spill);
 	write_id->filename = fl->filename;
-	write_id->offset = offset;
-	write_id->length = length;
-	write_id->old_data = new char[length];
-	write_id->data = new char[length];
-	memcpy(write_id->old_data, fl->data + offset, length);
-	memcpy(write_id->data, data, length);
-	memcpy(fl->data + offset, write_id->data, length);
+	write_id->offset = iov[0].offset;
+	write_id->ranges.assign(iov, iov + iovcnt);
+	off_t pos = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		write_id->ranges[i].buf = write_id->data + pos;
+		memcpy(write_id->ranges[i].buf, iov[i].buf, iov[i].length);
+		pos += iov[i].length;
+	}
+	pthread_mutex_lock(&fl->lock);
+	// a write past the end grows the file
+	if (end > fl->file_length && file_grow(gtfs, fl, end) == -1) {
+		pthread_mutex_unlock(&fl->lock);
+		write_free(write_id);
+		return NULL;
+	}
+	// the undo record holds every range as it was before the write; an abort
+	// restores them last to first, which also undoes overlapping ranges
+	vector<struct iovec> old(iovcnt);
+	for (int i = 0; i < iovcnt; i++) {
+		const gtfs_iovec_t& r = write_id->ranges[i];
+		file_materialize(gtfs, fl, r.offset, r.length);
+		old[i].iov_base = fl->data + r.offset;
+		old[i].iov_len = r.length;
+	}
+	if (spill && (write_id->undo_fd = undo_spill(gtfs, old)) == -1) {
+		// keep it in memory after all
+		write_id->old_data = pool_alloc(gtfs, length);
+	}
+	for (int i = 0; i < iovcnt && write_id->old_data != NULL; i++) {
+		const gtfs_iovec_t& r = write_id->ranges[i];
+		memcpy(write_id->old_data + (r.buf - write_id->data), fl->data + r.offset, r.length);
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		const gtfs_iovec_t& r = write_id->ranges[i];
+		memcpy(fl->data + r.offset, r.buf, r.length);
+		file_mark_dirty(fl, r.offset, r.length, 1, false);
+	}
+	pthread_mutex_unlock(&fl->lock);
 	write_id->shm_id = gtfs->shm_id;
 	write_id->sem_id = gtfs->sem_id;
 	write_id->log_fd = gtfs->log_fd;
-	write_id->file = fl; 
+	write_id->file = fl;
+	return write_id;
+}
+
+write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, off_t offset, off_t length, const char* data) {
+	write_t *write_id = NULL;
+	if (gtfs and fl) {
+		VERBOSE_PRINT(do_verbose, "Writting " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "GTFileSystem or file is not existed\n");
+		return NULL;
+	}
+	//TODO: Any additional initializations and checks
+	if (fl->data == NULL || offset < 0 || length < 0 || length > INT64_MAX - offset) {
+		VERBOSE_PRINT(do_verbose, "Range is out of file bounds\n");
+		return NULL;
+	}
+	uint64_t start = stats_now();
+	gtfs_iovec_t range = { offset, length, (char*) data };
+	write_id = write_start(gtfs, fl, &range, 1);
+	if (write_id == NULL) return NULL;
 	
+	stats_op(gtfs, GTFS_OP_WRITE, start);
 	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns non NULL.
 
 	return write_id;	
 }
 
-int gtfs_sync_write_file(write_t* write_id) {
-	int ret = -1;
+write_t* gtfs_writev_file(gtfs_t* gtfs, file_t* fl, const gtfs_iovec_t* iov, int iovcnt) {
+	write_t *write_id = NULL;
+	if (gtfs and fl and iov and iovcnt > 0) {
+		VERBOSE_PRINT(do_verbose, "Writting " << iovcnt << " ranges starting from offset " << iov[0].offset << " inside file " << fl->filename << "\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "GTFileSystem, file or ranges are not existed\n");
+		return NULL;
+	}
+	for (int i = 0; i < iovcnt; i++) {
+		if (fl->data == NULL || iov[i].offset < 0 || iov[i].length < 0 || iov[i].length > INT64_MAX - iov[i].offset || (iov[i].buf == NULL && iov[i].length > 0)) {
+			VERBOSE_PRINT(do_verbose, "Range is out of file bounds\n");
+			return NULL;
+		}
+	}
+	uint64_t start = stats_now();
+	write_id = write_start(gtfs, fl, iov, iovcnt);
+	if (write_id == NULL) return NULL;
+
+	stats_op(gtfs, GTFS_OP_WRITE, start);
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns non NULL.
+	return write_id;
+}
+
+// put back what a write replaced in the in-memory data of its file, ranges
+// last to first, and release its pages
+static void write_undo(write_t* write_id) {
+	pthread_mutex_lock(&write_id->file->lock);
+	char* file_data = write_id->file->data;
+	for (size_t i = write_id->ranges.size(); i-- > 0 && file_data != NULL;) {
+		const gtfs_iovec_t& r = write_id->ranges[i];
+		off_t pos = r.buf - write_id->data;
+		if (write_id->undo_fd != -1) {
+			undo_restore(write_id->undo_fd, file_data + r.offset, r.length, pos);
+		} else {
+			memcpy(file_data + r.offset, write_id->old_data + pos, r.length);
+		}
+		file_mark_dirty(write_id->file, r.offset, r.length, -1, false);
+	}
+	file_shrink(write_id->gtfs, write_id->file);
+	pthread_mutex_unlock(&write_id->file->lock);
+}
+
+// the end of a sync: count the record, let the write's pages be flushed (or
+// undo the write if it failed) and recycle the write; returns what the sync
+// returns
+static ssize_t write_finish(write_t* write_id, ssize_t ret) {
+	if (ret == 0) {
+		ret = write_id->length;
+		int f = write_id->file->shared_file;
+		if (f != -1) __atomic_add_fetch(&write_id->gtfs->shared->files[f].record_count, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_lock(&write_id->file->lock);
+		for (size_t i = 0; i < write_id->ranges.size() && write_id->file->data != NULL; i++) {
+			file_mark_dirty(write_id->file, write_id->ranges[i].offset, write_id->ranges[i].length, -1, true);
+		}
+		pthread_mutex_unlock(&write_id->file->lock);
+	} else {
+		// the write never reached the log: it is aborted, so that no flush puts
+		// it in the file
+		write_undo(write_id);
+	}
+	write_free(write_id);
+	return ret;
+}
+
+static void write_sync_complete(commit_req* req) {
+	gtfs_t* gtfs = req->write->gtfs;
+	ssize_t ret = write_finish(req->write, req->ret);
+	stats_op(gtfs, GTFS_OP_SYNC, req->submitted);
+	req->callback(req->callback_arg, ret);
+	delete req;
+}
+
+ssize_t gtfs_sync_write_file(write_t* write_id) {
+	ssize_t ret = -1;
 	if (write_id) {
 		VERBOSE_PRINT(do_verbose, "Persisting write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
 	} else {
@@ -313,25 +2944,40 @@ int gtfs_sync_write_file(write_t* write_id) {
 		return ret;
 	}
 	//TODO: Any additional initializations and checks
-	semop(write_id->sem_id, &op1, 1);
-	//off_t cur_pos = lseek(write_id->log_fd, 0, SEEK_CUR);
-	//cout << "cur_pos: " << cur_pos << endl;
-	int filename_length = strlen((write_id->filename).c_str());
-	char valid = 1;
-	//cout << "In gtfs_sync_write_file, filename: " << (write_id->filename).c_str() << endl;
-	if (write(write_id->log_fd, &filename_length, sizeof(int)) == -1) perror("In gtfs_sync_write_file, when writing filename_length");
-	if (write(write_id->log_fd, (write_id->filename).c_str(), filename_length) == -1) perror("In gtfs_sync_write_file, when writing filename");
-	if (write(write_id->log_fd, &(write_id->offset), sizeof(int)) == -1) perror("In gtfs_sync_write_file, when writing offset");
-	if (write(write_id->log_fd, &(write_id->length), sizeof(int)) == -1) perror("In gtfs_sync_write_file, when writing length");
-	if (write(write_id->log_fd, write_id->data, write_id->length) == -1) perror("In gtfs_sync_write_file, when writing data");
-	if (write(write_id->log_fd, &valid, 1) == -1) perror("In gtfs_sync_write_file, when writing valid bit");
-	semop(write_id->sem_id, &op2, 1);
-	delete write_id;
+	// the same request as gtfs_sync_write_file_async, waited for in place
+	gtfs_t* gtfs = write_id->gtfs;
+	uint64_t start = stats_now();
+	commit_req req;
+	log_record_init_write(gtfs, &req, write_id);
+	ret = write_finish(write_id, group_commit(gtfs, &req));
+	stats_op(gtfs, GTFS_OP_SYNC, start);
 	
 	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns number of bytes written.
 	return ret;	
 }
 
+int gtfs_sync_write_file_async(write_t* write_id, gtfs_sync_callback_t callback, void* arg) {
+	int ret = -1;
+	if (write_id and callback) {
+		VERBOSE_PRINT(do_verbose, "Persisting write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << " asynchronously\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "Write operation or callback is not exist\n");
+		return ret;
+	}
+	commit_req* req = new commit_req;
+	log_record_init_write(write_id->gtfs, req, write_id);
+	req->complete = write_sync_complete;
+	req->submitted = stats_now();
+	req->write = write_id;
+	req->callback = callback;
+	req->callback_arg = arg;
+	ret = group_commit(write_id->gtfs, req);
+	if (ret == -1) delete req;
+
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns 0.
+	return ret;
+}
+
 int gtfs_abort_write_file(write_t* write_id) {
 	int ret = -1;
 	if (write_id) {
@@ -341,11 +2987,359 @@ int gtfs_abort_write_file(write_t* write_id) {
 		return ret;
 	}
 	//TODO: Any additional initializations and checks
-	char* file_data = write_id->file->data;
-	memcpy(file_data + write_id->offset, write_id->old_data, write_id->length);
-	delete write_id;
+	uint64_t start = stats_now();
+	gtfs_t* gtfs = write_id->gtfs;
+	write_undo(write_id);
+	write_free(write_id);
 	
+	stats_op(gtfs, GTFS_OP_ABORT, start);
 	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns 0.
+	ret = 0;
 	return ret;	
 }
 
+// add [offset, offset + length) to the ranges of a file, merging it with the
+// ranges it overlaps or touches; the new data wins
+static void txn_merge(map<off_t, string>& ranges, off_t offset, off_t length, const char* data) {
+	off_t start = offset, end = offset + length;
+	map<off_t, string>::iterator first = ranges.upper_bound(start);
+	if (first != ranges.begin()) {
+		map<off_t, string>::iterator prev = first;
+		--prev;
+		if (prev->first + (off_t) prev->second.size() >= start) first = prev;
+	}
+	map<off_t, string>::iterator last = first;
+	off_t merged_start = start, merged_end = end;
+	while (last != ranges.end() && last->first <= end) {
+		merged_start = min(merged_start, last->first);
+		merged_end = max(merged_end, last->first + (off_t) last->second.size());
+		++last;
+	}
+	string merged(merged_end - merged_start, '\0');
+	for (map<off_t, string>::iterator it = first; it != last; ++it) merged.replace(it->first - merged_start, it->second.size(), it->second);
+	merged.replace(start - merged_start, length, data, length);
+	ranges.erase(first, last);
+	ranges[merged_start].swap(merged);
+}
+
+txn_t* gtfs_begin(gtfs_t* gtfs) {
+	txn_t* txn = NULL;
+	if (gtfs) {
+		VERBOSE_PRINT(do_verbose, "Beginning transaction inside directory " << gtfs->dirname << "\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "GTFileSystem is not existed\n");
+		return NULL;
+	}
+	txn = new txn_t;
+	txn->gtfs = gtfs;
+
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns non NULL.
+	return txn;
+}
+
+ssize_t gtfs_txn_write(txn_t* txn, file_t* fl, off_t offset, off_t length, const char* data) {
+	ssize_t ret = -1;
+	if (txn and fl) {
+		VERBOSE_PRINT(do_verbose, "Writting " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << " in a transaction\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "Transaction or file is not existed\n");
+		return ret;
+	}
+	if (fl->data == NULL || offset < 0 || length < 0 || length > fl->file_length - offset) {
+		VERBOSE_PRINT(do_verbose, "Range is out of file bounds\n");
+		return ret;
+	}
+	uint64_t start = stats_now();
+	size_t f = 0;
+	while (f < txn->files.size() && txn->files[f] != fl) f++;
+	if (f == txn->files.size()) {
+		txn->files.push_back(fl);
+		txn->ranges.push_back(map<off_t, string>());
+	}
+	txn_merge(txn->ranges[f], offset, length, data);
+	pthread_mutex_lock(&fl->lock);
+	file_materialize(txn->gtfs, fl, offset, length);
+	txn_undo_t undo;
+	undo.file = fl;
+	undo.offset = offset;
+	undo.old_data.assign(fl->data + offset, length);
+	txn->undo.push_back(undo);
+	memcpy(fl->data + offset, data, length);
+	file_mark_dirty(fl, offset, length, 1, false);
+	pthread_mutex_unlock(&fl->lock);
+	ret = length;
+
+	stats_op(txn->gtfs, GTFS_OP_WRITE, start);
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns number of bytes written.
+	return ret;
+}
+
+// put back what the writes of a transaction replaced, newest first so that
+// every byte gets its oldest value back, and release their pages
+static void txn_undo(txn_t* txn) {
+	for (size_t i = txn->undo.size(); i-- > 0;) {
+		txn_undo_t& undo = txn->undo[i];
+		pthread_mutex_lock(&undo.file->lock);
+		if (undo.file->data != NULL) {
+			memcpy(undo.file->data + undo.offset, undo.old_data.data(), undo.old_data.size());
+			file_mark_dirty(undo.file, undo.offset, undo.old_data.size(), -1, false);
+			file_shrink(txn->gtfs, undo.file);
+		}
+		pthread_mutex_unlock(&undo.file->lock);
+	}
+}
+
+ssize_t gtfs_commit(txn_t* txn) {
+	ssize_t ret = -1;
+	if (txn) {
+		VERBOSE_PRINT(do_verbose, "Committing transaction of " << txn->files.size() << " files inside directory " << txn->gtfs->dirname << "\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "Transaction is not existed\n");
+		return ret;
+	}
+	gtfs_t* gtfs = txn->gtfs;
+	uint64_t start = stats_now();
+	// serialize every range into the payload of one LOG_TXN record
+	vector<char> payload;
+	int count = 0;
+	long long bytes = 0;
+	uint32_t crc = CRC32C_INIT;
+	for (size_t f = 0; f < txn->files.size(); f++) {
+		const string& filename = txn->files[f]->filename;
+		map<off_t, string>::iterator it;
+		for (it = txn->ranges[f].begin(); it != txn->ranges[f].end(); ++it) {
+			txn_range_append(payload, crc, filename, it->first, it->second.data(), it->second.size());
+			bytes += it->second.size();
+			count++;
+		}
+	}
+	ret = 0;
+	if (count > 0) {
+		commit_req req;
+		log_record_init_txn(&req, count, payload, crc);
+		ret = group_commit(txn->gtfs, &req);
+	}
+	if (ret == 0) {
+		ret = bytes;
+		for (size_t f = 0; f < txn->files.size(); f++) {
+			int sf = txn->files[f]->shared_file;
+			if (sf != -1) __atomic_add_fetch(&txn->gtfs->shared->files[sf].record_count, 1, __ATOMIC_SEQ_CST);
+		}
+	}
+	if (ret >= 0) {
+		for (size_t i = 0; i < txn->undo.size(); i++) {
+			txn_undo_t& undo = txn->undo[i];
+			pthread_mutex_lock(&undo.file->lock);
+			if (undo.file->data != NULL) file_mark_dirty(undo.file, undo.offset, undo.old_data.size(), -1, true);
+			pthread_mutex_unlock(&undo.file->lock);
+		}
+	} else {
+		// nothing reached the log: roll back, so that no flush puts the writes
+		// in the files
+		txn_undo(txn);
+	}
+	delete txn;
+	stats_op(gtfs, GTFS_OP_SYNC, start);
+
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns number of bytes written.
+	return ret;
+}
+
+int gtfs_rollback(txn_t* txn) {
+	int ret = -1;
+	if (txn) {
+		VERBOSE_PRINT(do_verbose, "Rolling back transaction of " << txn->files.size() << " files inside directory " << txn->gtfs->dirname << "\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "Transaction is not existed\n");
+		return ret;
+	}
+	gtfs_t* gtfs = txn->gtfs;
+	uint64_t start = stats_now();
+	txn_undo(txn);
+	delete txn;
+	stats_op(gtfs, GTFS_OP_ABORT, start);
+	ret = 0;
+
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns 0.
+	return ret;
+}
+
+int gtfs_flush_file(gtfs_t* gtfs, file_t* fl) {
+	int ret = -1;
+	if (gtfs and fl) {
+		VERBOSE_PRINT(do_verbose, "Flushing dirty pages of file " << fl->filename << " inside directory " << gtfs->dirname << "\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "GTFileSystem or file is not existed\n");
+		return ret;
+	}
+	long page_size = sysconf(_SC_PAGESIZE);
+	int flushed = 0;
+	pthread_mutex_lock(&fl->lock);
+	if (fl->data == NULL) {
+		pthread_mutex_unlock(&fl->lock);
+		VERBOSE_PRINT(do_verbose, "File is closed\n");
+		return ret;
+	}
+	ret = 0;
+	// write the dirty bytes with one pwrite() per run of them on pages with no
+	// unsynced write; those on the other pages stay dirty
+	map<off_t, off_t> kept;
+	long last_page = -1;
+	map<off_t, off_t>::iterator it = fl->dirty_extents.begin();
+	while (it != fl->dirty_extents.end() && ret == 0) {
+		off_t pos = it->first, end = min(it->second, (off_t) fl->file_length);
+		while (pos < end) {
+			off_t run_end = pos;
+			while (run_end < end && !fl->unsynced_pages.count(run_end / page_size)) run_end = min((run_end / page_size + 1) * page_size, end);
+			if (run_end == pos) {
+				off_t next = min((pos / page_size + 1) * page_size, end);
+				file_add_extent(kept, pos, next);
+				pos = next;
+				continue;
+			}
+			if (pwrite(fl->fd, fl->data + pos, run_end - pos, pos) != run_end - pos) {
+				perror("In gtfs_flush_file(), when writing file");
+				ret = -1;
+				break;
+			}
+			long first = pos / page_size;
+			if (first == last_page) first++;
+			last_page = (run_end - 1) / page_size;
+			flushed += last_page - first + 1;
+			pos = run_end;
+		}
+		if (ret == 0) fl->dirty_extents.erase(it++);
+	}
+	for (it = kept.begin(); it != kept.end(); ++it) file_add_extent(fl->dirty_extents, it->first, it->second);
+	pthread_mutex_unlock(&fl->lock);
+	if (ret == 0 && flushed > 0) {
+		stats_add(stats_shard(gtfs).fsyncs, 1);
+		if (fdatasync(fl->fd) == -1) {
+			perror("In gtfs_flush_file(), when syncing file");
+			ret = -1;
+		}
+	}
+	if (ret == -1) return ret;
+	ret = flushed;
+
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns number of pages written.
+	return ret;
+}
+
+gtfs_stats_t gtfs_get_stats(gtfs_t* gtfs) {
+	gtfs_stats_t total;
+	memset(&total, 0, sizeof(total));
+	if (!gtfs) return total;
+	// the fields are all counters: sum them up across shards
+	const size_t fields = sizeof(gtfs_stats_t) / sizeof(uint64_t);
+	uint64_t* sum = (uint64_t*) &total;
+	for (int i = 0; i < GTFS_STATS_SHARDS; i++) {
+		uint64_t* shard = (uint64_t*) &gtfs->stats[i].s;
+		for (size_t k = 0; k < fields; k++) sum[k] += __atomic_load_n(&shard[k], __ATOMIC_RELAXED);
+	}
+	// except max_ns
+	for (int op = 0; op < GTFS_OP_COUNT; op++) {
+		total.ops[op].max_ns = 0;
+		for (int i = 0; i < GTFS_STATS_SHARDS; i++) total.ops[op].max_ns = max(total.ops[op].max_ns, __atomic_load_n(&gtfs->stats[i].s.ops[op].max_ns, __ATOMIC_RELAXED));
+	}
+	return total;
+}
+
+// one JSON object with the stats of gtfs
+static string stats_json(gtfs_t* gtfs) {
+	gtfs_stats_t st = gtfs_get_stats(gtfs);
+	stringstream ss;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	ss << "{\"time_ms\":" << now.tv_sec * 1000LL + now.tv_usec / 1000 << ",\"dir\":\"" << gtfs->dirname << "\"";
+	for (int op = 0; op < GTFS_OP_COUNT; op++) {
+		const gtfs_op_stats_t& o = st.ops[op];
+		ss << ",\"" << stats_op_names[op] << "\":{\"count\":" << o.count << ",\"total_ns\":" << o.total_ns << ",\"max_ns\":" << o.max_ns << ",\"buckets_us\":[";
+		int last = GTFS_STATS_BUCKETS - 1;
+		while (last > 0 && o.buckets[last] == 0) last--;
+		for (int b = 0; b <= last; b++) ss << (b ? "," : "") << o.buckets[b];
+		ss << "]}";
+	}
+	ss << ",\"log_records\":" << st.log_records << ",\"log_bytes\":" << st.log_bytes << ",\"fsyncs\":" << st.fsyncs;
+	ss << ",\"lock_waits\":" << st.lock_waits << ",\"lock_wait_ns\":" << st.lock_wait_ns;
+	ss << ",\"replay_records\":" << st.replay_records << ",\"scanned_records\":" << st.scanned_records << "}";
+	return ss.str();
+}
+
+static void* stats_dump_thread(void* arg) {
+	gtfs_t* gtfs = (gtfs_t*) arg;
+	pthread_mutex_lock(&gtfs->stats_lock);
+	for (;;) {
+		while (gtfs->stats_dump_interval_ms <= 0) pthread_cond_wait(&gtfs->stats_cond, &gtfs->stats_lock);
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		long long deadline_us = now.tv_sec * 1000000LL + now.tv_usec + gtfs->stats_dump_interval_ms * 1000LL;
+		struct timespec deadline;
+		deadline.tv_sec = deadline_us / 1000000;
+		deadline.tv_nsec = (deadline_us % 1000000) * 1000;
+		if (pthread_cond_timedwait(&gtfs->stats_cond, &gtfs->stats_lock, &deadline) != ETIMEDOUT) continue;
+		string path = gtfs->stats_dump_path;
+		pthread_mutex_unlock(&gtfs->stats_lock);
+		string line = stats_json(gtfs) + "\n";
+		int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_APPEND, S_IRUSR | S_IWUSR);
+		if (fd == -1 || write(fd, line.c_str(), line.size()) != (ssize_t) line.size()) perror("In stats_dump_thread(), when writing stats");
+		if (fd != -1) close(fd);
+		pthread_mutex_lock(&gtfs->stats_lock);
+	}
+	return NULL;
+}
+
+int gtfs_set_stats_dump(gtfs_t* gtfs, string path, int interval_ms) {
+	int ret = -1;
+	if (gtfs) {
+		VERBOSE_PRINT(do_verbose, "Dumping stats of directory " << gtfs->dirname << " to " << path << " every " << interval_ms << " ms\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "GTFileSystem is not existed\n");
+		return ret;
+	}
+	pthread_mutex_lock(&gtfs->stats_lock);
+	gtfs->stats_dump_path = path;
+	gtfs->stats_dump_interval_ms = interval_ms > 0 ? interval_ms : 0;
+	if (interval_ms > 0 && !gtfs->stats_dump_started) {
+		pthread_t tid;
+		if (pthread_create(&tid, NULL, stats_dump_thread, gtfs) == 0) {
+			pthread_detach(tid);
+			gtfs->stats_dump_started = true;
+		} else {
+			perror("In gtfs_set_stats_dump(), when starting dump thread");
+			gtfs->stats_dump_interval_ms = 0;
+			pthread_mutex_unlock(&gtfs->stats_lock);
+			return ret;
+		}
+	}
+	pthread_cond_signal(&gtfs->stats_cond);
+	pthread_mutex_unlock(&gtfs->stats_lock);
+	ret = 0;
+
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns 0.
+	return ret;
+}
+
+int gtfs_get_file_info(gtfs_t* gtfs, string filename, int* open_handles, int* log_records) {
+	int ret = -1;
+	if (gtfs) {
+		VERBOSE_PRINT(do_verbose, "Getting shared info of file " << filename << " inside directory " << gtfs->dirname << "\n");
+	} else {
+		VERBOSE_PRINT(do_verbose, "GTFileSystem is not existed\n");
+		return ret;
+	}
+	int opened = 0, records = 0;
+	dir_lock(gtfs);
+	int f = shared_file_find(gtfs->shared, filename, false);
+	if (f != -1) {
+		opened = __atomic_load_n(&gtfs->shared->files[f].open_count, __ATOMIC_SEQ_CST);
+		records = __atomic_load_n(&gtfs->shared->files[f].record_count, __ATOMIC_SEQ_CST);
+	}
+	dir_unlock(gtfs);
+	if (open_handles) *open_handles = opened;
+	if (log_records) *log_records = records;
+	ret = 0;
+
+	VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns 0.
+	return ret;
+}
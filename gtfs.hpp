@@ -12,17 +12,37 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <vector>
+#include <algorithm> // min, max
 #include <unistd.h>
-#include <unordered_map> // used in gtfs_clean() to cache file descriptors
+#include <unordered_map> // used by checkpoints to cache file descriptors
+#include <map> // used by the checkpointer to coalesce log records, and for dirty bytes
 #include <pthread.h> // to use pthread mutex
 #include <sys/ipc.h>
 #include <sys/sem.h> // to use semaphore
 #include <sys/shm.h> // to use shared memory
+#include <signal.h> // kill, to find appenders that died
+#include <sched.h> // sched_yield
 #include <string.h> // strcpy, strcmp
 #include <sstream> // to concatenate multiple strings
+#include <sys/uio.h> // writev, to append a batch of log records at once
+#include <sys/time.h> // gettimeofday, for group commit deadlines
+#include <errno.h>
+#include <limits.h> // IOV_MAX
+#include <stdint.h> // fixed-width fields of the on-disk log format
+#include <stddef.h> // offsetof
+#if defined(__x86_64__)
+#include <nmmintrin.h> // SSE4.2 crc32 instruction, for log record checksums
+#define GTFS_HAVE_SSE42 1
+#else
+#define GTFS_HAVE_SSE42 0
+#endif
 
 using namespace std;
 
+// files, offsets and lengths are off_t, which has to be 64-bit in the library
+// and in every program using it: build both with -D_FILE_OFFSET_BITS=64
+static_assert(sizeof(off_t) == 8, "gtfs needs a 64-bit off_t, build with -D_FILE_OFFSET_BITS=64");
+
 #define PASS "\033[32;1m PASS \033[0m\n"
 #define FAIL "\033[31;1m FAIL \033[0m\n"
 
@@ -32,52 +52,336 @@ using namespace std;
 #define MAX_NUM_FILES_PER_DIR 1024
 #define MAX_LOG_SIZE 1024
 
+// group commit defaults (see gtfs_t::commit_max_batch / commit_max_wait_us)
+#define DEFAULT_COMMIT_MAX_BATCH 64
+#define DEFAULT_COMMIT_MAX_WAIT_US 0
+
+// how many times in a row the directory lock may pass between threads of one
+// process before the semaphore is released for other processes
+#define DIR_LOCK_MAX_HANDOFFS 64
+
+// how many appenders (group commit leaders, in all processes) may have a log
+// region reserved in the shared control block at the same time
+#define SHARED_MAX_APPENDERS 64
+
+// checkpoint the log in the background once it grows past this many bytes
+// (see gtfs_t::checkpoint_threshold, 0 disables background checkpoints)
+#define DEFAULT_CHECKPOINT_THRESHOLD 0
+// largest amount of log data the checkpointer buffers before writing it out
+#define CHECKPOINT_CHUNK_SIZE (4 * 1024 * 1024)
+// threads (the caller included) that verify the log in recovery scans and
+// apply it to the files, one file at a time, in checkpoints (gtfs_init arg,
+// see gtfs_t::recovery_threads): 0 for one per online CPU, 1 does it all in
+// the calling thread
+#define DEFAULT_RECOVERY_THREADS 0
+// records a recovery scan walks ahead before verifying them together
+#define SCAN_BATCH_RECORDS 4096
+// size of the log segment files of a new directory; a checkpoint deletes the
+// segments it has fully applied, so the log never has to be emptied in place
+#define DEFAULT_LOG_SEGMENT_SIZE (16 * 1024 * 1024)
+// synced writes of at least this many bytes are compressed in the log when
+// that makes them smaller (see gtfs_t::log_compress_threshold, 0 disables it)
+#define DEFAULT_LOG_COMPRESS_THRESHOLD 0
+// files are extended (when opened longer, grown or checkpointed) with
+// fallocate(), which allocates their blocks up front so that later writes do
+// not update their metadata, instead of being left sparse (see
+// gtfs_t::file_prealloc, 0 disables it)
+#define DEFAULT_FILE_PREALLOC 0
+// most bytes the in-memory data of a GTFS_DATA_COPY file grows by beyond a
+// write past its end; below this it doubles
+#define FILE_GROW_MAX_STEP (1LL << 30)
+// descriptors of files that checkpoints keep open for the next checkpoint
+#define FILE_FD_CACHE_MAX 256
+// whether files opened in GTFS_DATA_COPY mode share their replayed image with
+// other processes through a shared memory segment (see gtfs_t::file_cache)
+#define DEFAULT_FILE_CACHE 0
+
+// write descriptors and payload buffers are recycled through pools owned by
+// gtfs_t; writes of up to WRITE_INLINE_SIZE bytes keep their data and undo
+// copy inside the descriptor itself
+#define WRITE_INLINE_SIZE 64
+// writes longer than this keep their undo record in a temporary file instead
+// of memory (see gtfs_t::undo_spill_threshold, 0 keeps every undo in memory)
+#define DEFAULT_UNDO_SPILL_THRESHOLD (1024 * 1024)
+#define POOL_MIN_BLOCK 128 // payload buffers come in blocks of POOL_MIN_BLOCK << class bytes
+#define POOL_CLASSES 10 // so the largest pooled block is 64KB, bigger ones use the heap
+#define POOL_MAX_CACHED 64 // free descriptors (or blocks of one class) kept for reuse
+
+// statistics: threads are spread over this many counter shards, and latencies
+// go in power-of-two buckets, bucket b holding those below 2^b microseconds
+#define GTFS_STATS_SHARDS 16
+#define GTFS_STATS_BUCKETS 32
+
+// how gtfs_open_file builds the in-memory version of a file (gtfs_init arg)
+#define GTFS_DATA_COPY 0 // read the whole file into the heap and replay its log records
+#define GTFS_DATA_MMAP 1 // map the file copy-on-write and replay log records on first touch
+
 extern int do_verbose;
 
+// location of one valid log record, as kept by the log index
+typedef struct log_extent {
+    off_t log_offset; // where the record's data starts inside the log
+    off_t offset; // where the data goes inside the file
+    off_t length;
+    off_t packed_length; // size of the compressed data at log_offset, 0 if it is stored as is
+} log_extent_t;
+
+// an open descriptor of a file, and its size as far as this process knows
+typedef struct file_fd {
+    int fd;
+    off_t size;
+} file_fd_t;
+
+struct write;
+
 typedef struct gtfs {
     string dirname;
     // TODO: Add any additional fields if necessary
     int shm_id; // use shared memory to store the current tail position of log file
     int sem_id; // use semaphore to synchronize write to log file
-    int log_fd; // file descriptor for the log file
+    int log_fd; // file descriptor for the log header (<dir>/log)
+    uint64_t segment_size; // the log's records live in segment files of this size
+    pthread_mutex_t segment_lock;
+    map<uint64_t, int> segment_fds; // open log segments, by number
+    // shared control block (see struct gtfs_shared in gtfs.cpp) attached from
+    // shm_id: log tail reservations and the per-file table
+    struct gtfs_shared* shared;
+    int gate_id; // semaphore held shared by appenders, and whole by a checkpoint
+    // in-process layer of the directory lock (see dir_lock() in gtfs.cpp)
+    pthread_mutex_t dir_mutex;
+    pthread_cond_t dir_cond;
+    bool dir_owned; // a thread of this process holds the directory
+    bool dir_sem_held; // this process holds the semaphore
+    int dir_waiters;
+    int dir_handoffs;
+    // group commit: concurrent syncers queue their records and one leader
+    // appends the whole batch with a single writev() and fdatasync()
+    int commit_max_batch; // max number of records flushed by one leader
+    int commit_max_wait_us; // how long a leader waits for more records to join
+    pthread_mutex_t commit_lock;
+    pthread_cond_t commit_cond;
+    vector<struct commit_req*> commit_queue;
+    bool commit_leader_active;
+    bool commit_thread_started; // leads batches of asynchronous syncs nobody waits for
+    // persistent log index (<dir>/log.idx): filename -> valid log records, so
+    // that opening a file only touches the records of that file
+    int idx_fd;
+    int idx_generation; // bumped whenever the index is reset or rebuilt
+    off_t idx_pos; // how much of the index file is loaded into log_index
+    off_t log_indexed; // log position up to which the index describes the log
+    unordered_map<string, vector<log_extent_t> > log_index;
+    unordered_map<string, off_t> log_dropped; // per file: its records before this log position were removed
+    int data_mode; // GTFS_DATA_COPY or GTFS_DATA_MMAP
+    int log_compress_threshold; // smallest write whose log record is compressed, 0: none
+    // opening a file starts from its cached image (and replays only the log
+    // records newer than it) instead of reading the file and its whole log
+    int file_cache;
+    // background checkpointer, started the first time the log grows past
+    // checkpoint_threshold bytes
+    off_t checkpoint_threshold;
+    pthread_mutex_t checkpoint_lock;
+    pthread_cond_t checkpoint_cond;
+    bool checkpoint_requested;
+    bool checkpoint_started;
+    // pooled write descriptors and payload buffers (see pool_alloc() in gtfs.cpp)
+    pthread_mutex_t pool_lock;
+    vector<struct write*> write_pool;
+    vector<char*> buffer_pool[POOL_CLASSES];
+    int undo_spill_threshold; // longest write whose undo record stays in memory
+    vector<char> scratch; // log scan and checkpoint buffer, used under the directory lock
+    int recovery_threads; // threads of recovery scans and checkpoints, 0: one per online CPU
+    int file_prealloc; // extend files with fallocate()
+    // descriptors of the files checkpoints wrote to, by filename; used under the
+    // directory lock, and dropped when the file is (or may have been) removed
+    unordered_map<string, file_fd_t> file_fds;
+    // counters and latency histograms (see gtfs_get_stats), one shard per
+    // group of threads so that no two threads fight over a cache line
+    struct gtfs_stats_shard* stats;
+    pthread_mutex_t stats_lock; // protects the fields below
+    pthread_cond_t stats_cond;
+    string stats_dump_path;
+    int stats_dump_interval_ms; // 0: no periodic dump
+    bool stats_dump_started;
 } gtfs_t;
 
 typedef struct file {
     string filename;
-	int file_length;
+	off_t file_length; // grows with writes past the end
     // TODO: Add any additional fields if necessary
     int fd; // file descriptor
     char* data; // in-memory version of data
+    off_t data_capacity; // bytes allocated for data (GTFS_DATA_COPY), at least file_length
+    int data_mode; // GTFS_DATA_MMAP: data is a private mapping of the file
+    // log records not yet applied to data (GTFS_DATA_MMAP only), and for each
+    // page the records touching it; a page is overlaid the first time it is used
+    vector<log_extent_t> pending;
+    unordered_map<long, vector<int> > pending_pages;
+    pthread_mutex_t lock; // protects data and pending records between threads
+    // bytes of data written by synced writes since they were last flushed to
+    // the file (start -> end), and for each page the writes to it not yet
+    // synced or aborted
+    map<off_t, off_t> dirty_extents;
+    unordered_map<long, int> unsynced_pages;
+    // the length of the file without the writes not yet synced, and the ends
+    // of those writes (with how many end there): an abort gives back the part
+    // of the file past all of them
+    off_t synced_length;
+    map<off_t, int> unsynced_ends;
+    int shared_file; // entry in the shared per-file table, or -1 if it is full
 } file_t;
 
+// one range of a vectored read or write
+typedef struct gtfs_iovec {
+    off_t offset; // inside the file
+    off_t length;
+    char* buf; // filled by gtfs_readv_file, copied by gtfs_writev_file
+} gtfs_iovec_t;
+
 typedef struct write {
     string filename;
-	int offset;
-	int length;
+	off_t offset;
+	off_t length;
 	char *data;
     // TODO: Add any additional fields if necessary
-    char* old_data; // undo record
+    // where the data goes, range by range, each buf pointing into data (and the
+    // same place of old_data); a single range unless from gtfs_writev_file
+    vector<gtfs_iovec_t> ranges;
+    char* old_data; // undo record, NULL if it was spilled to undo_fd
+    int undo_fd; // unlinked temporary file holding the undo record, or -1
     int shm_id;
     int sem_id;
     int log_fd;
     file_t* file; // to manipulate in-memory version of data
+    gtfs_t* gtfs; // owning file system, used to join its group commit
+    char inline_buf[2 * WRITE_INLINE_SIZE]; // data and old_data of small writes
 } write_t;
 
 // GTFileSystem basic API calls
 
-gtfs_t* gtfs_init(string directory, int verbose_flag);
+gtfs_t* gtfs_init(string directory, int verbose_flag, int data_mode = GTFS_DATA_COPY, int recovery_threads = DEFAULT_RECOVERY_THREADS);
 int gtfs_clean(gtfs_t *gtfs);
 
-file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length);
+file_t* gtfs_open_file(gtfs_t* gtfs, string filename, off_t file_length);
 int gtfs_close_file(gtfs_t* gtfs, file_t* fl);
 int gtfs_remove_file(gtfs_t* gtfs, file_t* fl);
 
-char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length);
-write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const char* data);
-int gtfs_sync_write_file(write_t* write_id);
+char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, off_t offset, off_t length);
+write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, off_t offset, off_t length, const char* data);
+ssize_t gtfs_sync_write_file(write_t* write_id);
 int gtfs_abort_write_file(write_t* write_id);
 
 // TODO: Add here any additional data structures or API calls
 
+// Offsets and lengths are 64-bit. gtfs_open_file opens a file with at least
+// file_length bytes: a file that is already longer (on disk or through log
+// records) keeps its length. A write past the end of a file grows it (and its
+// in-memory data, which moves: views taken before are no longer valid).
+
+// Vectored versions of gtfs_read_file_into and gtfs_write_file: the ranges are
+// read, or written in order, under one lock of the file. All the ranges of a
+// vectored write are synced or aborted together (with the other calls on a
+// write_t) and reach the log as one record. gtfs_readv_file returns the total
+// number of bytes read or -1. The write_t of a vectored write has the offset
+// of its first range and the length of all of them.
+ssize_t gtfs_readv_file(gtfs_t* gtfs, file_t* fl, const gtfs_iovec_t* iov, int iovcnt);
+write_t* gtfs_writev_file(gtfs_t* gtfs, file_t* fl, const gtfs_iovec_t* iov, int iovcnt);
+
+// Called once an asynchronous sync is over, with what gtfs_sync_write_file
+// would have returned (the number of bytes written, or -1).
+typedef void (*gtfs_sync_callback_t)(void* arg, ssize_t ret);
+
+// Queues the write's log record for the next group commit and returns 0 right
+// away (or -1 if it could not be queued). callback runs once the record is
+// durable, on the thread that led its batch: a thread inside a sync of the
+// same gtfs_t, or a background committer. Like gtfs_sync_write_file, it
+// ends the write: write_id must not be used once this returns 0.
+// gtfs_sync_write_file(w) is this call followed by waiting for the callback.
+int gtfs_sync_write_file_async(write_t* write_id, gtfs_sync_callback_t callback, void* arg);
+
+// read-only view into the in-memory version of a file, returned by gtfs_read_view
+typedef struct gtfs_view {
+    const char* data; // NULL if the range is invalid
+    off_t length;
+} gtfs_view_t;
+
+// Zero-copy read: the view points into fl's in-memory data and stays valid
+// until fl is closed, removed or grown. It is not a snapshot: a later
+// gtfs_write_file or gtfs_abort_write_file on the same range shows through,
+// so copy the bytes out (or use gtfs_read_file_into) if they must not change.
+gtfs_view_t gtfs_read_view(gtfs_t* gtfs, file_t* fl, off_t offset, off_t length);
+// Copies the range into the caller's buffer; returns the number of bytes read or -1.
+ssize_t gtfs_read_file_into(gtfs_t* gtfs, file_t* fl, off_t offset, off_t length, char* buf);
+
+// A transaction groups writes to one or more files into a single log record,
+// so that they are persisted (or lost in a crash) all together. Writes show in
+// the files' in-memory data right away, as with gtfs_write_file; overlapping
+// and adjacent writes to a file are merged before they reach the log.
+typedef struct txn_undo {
+    file_t* file;
+    off_t offset;
+    string old_data;
+} txn_undo_t;
+
+typedef struct txn {
+    gtfs_t* gtfs;
+    vector<file_t*> files; // files written, in order of first write
+    vector<map<off_t, string> > ranges; // per file: offset -> data, no two ranges overlap or touch
+    vector<txn_undo_t> undo; // data replaced by each write, for gtfs_rollback
+} txn_t;
+
+txn_t* gtfs_begin(gtfs_t* gtfs);
+// Returns the number of bytes written or -1; unlike gtfs_write_file, it does not
+// grow the file.
+ssize_t gtfs_txn_write(txn_t* txn, file_t* fl, off_t offset, off_t length, const char* data);
+// Both end the transaction and free txn. gtfs_commit returns the number of
+// bytes persisted (after merging) or -1.
+ssize_t gtfs_commit(txn_t* txn);
+int gtfs_rollback(txn_t* txn);
+
+// Writes the pages of fl modified since they were last flushed straight to
+// its file, and syncs it. Pages with writes that are neither synced nor
+// aborted yet are skipped (and flushed by a later call), so the file only
+// ever gets durable data. Returns the number of pages written or -1.
+int gtfs_flush_file(gtfs_t* gtfs, file_t* fl);
+
+// operations with a count and a latency histogram in gtfs_stats_t
+enum gtfs_op {
+    GTFS_OP_OPEN,
+    GTFS_OP_READ, // gtfs_read_file, gtfs_read_view and gtfs_read_file_into
+    GTFS_OP_WRITE, // gtfs_write_file and gtfs_txn_write
+    GTFS_OP_SYNC, // gtfs_sync_write_file (and its async variant, up to the callback) and gtfs_commit
+    GTFS_OP_ABORT, // gtfs_abort_write_file and gtfs_rollback
+    GTFS_OP_REMOVE,
+    GTFS_OP_CLEAN,
+    GTFS_OP_COUNT
+};
+
+typedef struct gtfs_op_stats {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[GTFS_STATS_BUCKETS];
+} gtfs_op_stats_t;
+
+typedef struct gtfs_stats {
+    gtfs_op_stats_t ops[GTFS_OP_COUNT];
+    uint64_t log_records; // appended to the log by this gtfs_t
+    uint64_t log_bytes;
+    uint64_t fsyncs; // fsync() and fdatasync() calls, on the log and on files
+    uint64_t lock_waits; // times the directory lock or the append gate was taken
+    uint64_t lock_wait_ns; // time spent waiting for them
+    uint64_t replay_records; // log records read into in-memory files (on open, or on first touch with GTFS_DATA_MMAP)
+    uint64_t scanned_records; // log records verified by recovery and index catch-up scans
+} gtfs_stats_t;
+
+// Totals since gtfs_init for this gtfs_t (all of its threads).
+gtfs_stats_t gtfs_get_stats(gtfs_t* gtfs);
+// Appends the stats as one JSON line to path every interval_ms milliseconds,
+// from a background thread; interval_ms 0 stops. Returns 0 or -1.
+int gtfs_set_stats_dump(gtfs_t* gtfs, string path, int interval_ms);
+
+// Number of open handles to a file (in all processes) and of its log records
+// since the last checkpoint, as kept in the directory's shared control block.
+int gtfs_get_file_info(gtfs_t* gtfs, string filename, int* open_handles, int* log_records);
 
 #endif
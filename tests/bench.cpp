@@ -0,0 +1,367 @@
+#include "../gtfs.hpp"
+
+// Measures the cost of GTFS operations. Every benchmark runs in a fresh
+// directory under the current one and prints one CSV line per configuration:
+//   benchmark,param,ops,p50_us,p90_us,p99_us,max_us,ops_per_sec,mb_per_sec
+// Latencies are per operation; throughput is ops (and payload bytes) over the
+// wall time of the whole run, so it includes concurrency.
+// Usage: ./bench [scale], where scale (default 1) multiplies the op counts.
+
+string directory;
+int scale = 1;
+int bench_seq = 0;
+
+static double now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void report(const string& name, const string& param, vector<double>& samples, double wall_us, double bytes) {
+	if (samples.empty()) return;
+	sort(samples.begin(), samples.end());
+	size_t n = samples.size();
+	printf("%s,%s,%zu,%.1f,%.1f,%.1f,%.1f,%.0f,%.2f\n", name.c_str(), param.c_str(), n,
+		samples[n * 50 / 100], samples[n * 90 / 100], samples[min(n - 1, n * 99 / 100)], samples[n - 1],
+		n / (wall_us / 1e6), bytes / (1024 * 1024) / (wall_us / 1e6));
+	fflush(stdout);
+}
+
+// a new, empty directory for one configuration
+static string bench_dir(const string& name) {
+	stringstream ss;
+	ss << directory << "/bench." << name << "." << getpid() << "." << bench_seq++;
+	mkdir(ss.str().c_str(), S_IRWXU);
+	return ss.str();
+}
+
+// forget the directory's shared control block and semaphores, as a reboot would
+static void bench_drop_ipc(const string& dir) {
+	int shm_id = shmget(ftok(dir.c_str(), 1), 0, 0666);
+	if (shm_id != -1) shmctl(shm_id, IPC_RMID, NULL);
+	for (int k = 1; k <= 2; k++) {
+		int sem_id = semget(ftok(dir.c_str(), k), 1, 0666);
+		if (sem_id != -1) semctl(sem_id, 0, IPC_RMID);
+	}
+}
+
+static void bench_remove_dir(const string& dir) {
+	bench_drop_ipc(dir);
+	system(("rm -rf " + dir).c_str());
+}
+
+// append a number of synced records of size bytes to filename
+static void fill_log(gtfs_t* gtfs, const string& filename, int records, int size) {
+	file_t* fl = gtfs_open_file(gtfs, filename, size);
+	string data(size, 'f');
+	for (int i = 0; i < records; i++) gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, size, data.c_str()));
+	gtfs_close_file(gtfs, fl);
+}
+
+// open latency of a file with a few records, with the log holding many
+// records of other files; then of a file with many records, with and without
+// the shared file cache
+static void bench_open() {
+	int sizes[] = { 0, 1000, 10000 };
+	for (int s = 0; s < 3; s++) {
+		string dir = bench_dir("open");
+		gtfs_t* gtfs = gtfs_init(dir, 0);
+		fill_log(gtfs, "other", sizes[s] * scale, 256);
+		fill_log(gtfs, "target", 10, 256);
+		vector<double> samples;
+		double start = now_us();
+		for (int i = 0; i < 200 * scale; i++) {
+			double t = now_us();
+			file_t* fl = gtfs_open_file(gtfs, "target", 4096);
+			samples.push_back(now_us() - t);
+			gtfs_close_file(gtfs, fl);
+		}
+		stringstream param;
+		param << "log_records=" << sizes[s] * scale;
+		report("open", param.str(), samples, now_us() - start, 0);
+		bench_remove_dir(dir);
+	}
+	for (int cache = 0; cache < 2; cache++) {
+		string dir = bench_dir("open");
+		gtfs_t* gtfs = gtfs_init(dir, 0);
+		gtfs->file_cache = cache;
+		fill_log(gtfs, "target", 1000 * scale, 4096);
+		vector<double> samples;
+		double start = now_us();
+		file_t* fl = NULL;
+		for (int i = 0; i < 200 * scale; i++) {
+			double t = now_us();
+			fl = gtfs_open_file(gtfs, "target", 4096);
+			samples.push_back(now_us() - t);
+			gtfs_close_file(gtfs, fl);
+		}
+		stringstream param;
+		param << "file_records=" << 1000 * scale << " file_cache=" << cache;
+		report("open", param.str(), samples, now_us() - start, 0);
+		// also drops the cache segment
+		gtfs_remove_file(gtfs, fl);
+		bench_remove_dir(dir);
+	}
+}
+
+struct sync_arg {
+	gtfs_t* gtfs;
+	int id;
+	int ops;
+	int size;
+	vector<double> samples;
+};
+
+static void* sync_worker(void* arg) {
+	sync_arg* a = (sync_arg*) arg;
+	stringstream ss;
+	ss << "file" << a->id;
+	file_t* fl = gtfs_open_file(a->gtfs, ss.str(), a->size);
+	string data(a->size, 'a' + a->id % 26);
+	for (int i = 0; i < a->ops; i++) {
+		double t = now_us();
+		gtfs_sync_write_file(gtfs_write_file(a->gtfs, fl, 0, a->size, data.c_str()));
+		a->samples.push_back(now_us() - t);
+	}
+	gtfs_close_file(a->gtfs, fl);
+	return NULL;
+}
+
+// write+sync latency and throughput by record size, threads of one process
+// and separate processes
+static void bench_sync() {
+	int sizes[] = { 64, 4096, 65536 };
+	int counts[] = { 1, 4 };
+	for (int s = 0; s < 3; s++) {
+		for (int c = 0; c < 2; c++) {
+			for (int procs = 0; procs < 2; procs++) {
+				int n = counts[c];
+				int ops = 200 * scale;
+				string dir = bench_dir("sync");
+				vector<double> samples;
+				double start = now_us();
+				if (!procs) {
+					gtfs_t* gtfs = gtfs_init(dir, 0);
+					vector<pthread_t> threads(n);
+					vector<sync_arg> args(n);
+					for (int t = 0; t < n; t++) {
+						args[t].gtfs = gtfs;
+						args[t].id = t;
+						args[t].ops = ops;
+						args[t].size = sizes[s];
+						pthread_create(&threads[t], NULL, sync_worker, &args[t]);
+					}
+					for (int t = 0; t < n; t++) {
+						pthread_join(threads[t], NULL);
+						samples.insert(samples.end(), args[t].samples.begin(), args[t].samples.end());
+					}
+				} else {
+					// every child sends its latencies back through a pipe
+					vector<int> pipes(n);
+					for (int p = 0; p < n; p++) {
+						int fds[2];
+						if (pipe(fds) == -1) return;
+						if (fork() == 0) {
+							close(fds[0]);
+							sync_arg a;
+							a.gtfs = gtfs_init(dir, 0);
+							a.id = p;
+							a.ops = ops;
+							a.size = sizes[s];
+							sync_worker(&a);
+							write(fds[1], &a.samples[0], a.samples.size() * sizeof(double));
+							_exit(0);
+						}
+						close(fds[1]);
+						pipes[p] = fds[0];
+					}
+					for (int p = 0; p < n; p++) {
+						double v;
+						while (read(pipes[p], &v, sizeof(v)) == sizeof(v)) samples.push_back(v);
+						close(pipes[p]);
+						wait(NULL);
+					}
+				}
+				stringstream param;
+				param << "size=" << sizes[s] << " " << (procs ? "procs=" : "threads=") << n;
+				report("write_sync", param.str(), samples, now_us() - start, (double) samples.size() * sizes[s]);
+				bench_remove_dir(dir);
+			}
+		}
+	}
+}
+
+// latency of 4KB reads at random offsets, copied into a caller buffer
+static void bench_read() {
+	int modes[] = { GTFS_DATA_COPY, GTFS_DATA_MMAP };
+	for (int m = 0; m < 2; m++) {
+		string dir = bench_dir("read");
+		gtfs_t* gtfs = gtfs_init(dir, 0, modes[m]);
+		int length = 16 * 1024 * 1024;
+		file_t* fl = gtfs_open_file(gtfs, "file", length);
+		char buf[4096];
+		memset(buf, 'r', sizeof(buf));
+		for (int i = 0; i < 64; i++) gtfs_sync_write_file(gtfs_write_file(gtfs, fl, (rand() % (length / 4096)) * 4096, 4096, buf));
+		vector<double> samples;
+		double start = now_us();
+		for (int i = 0; i < 20000 * scale; i++) {
+			int offset = (rand() % (length / 4096)) * 4096;
+			double t = now_us();
+			gtfs_read_file_into(gtfs, fl, offset, 4096, buf);
+			samples.push_back(now_us() - t);
+		}
+		report("read", modes[m] == GTFS_DATA_MMAP ? "mode=mmap" : "mode=copy", samples, now_us() - start, (double) samples.size() * 4096);
+		gtfs_close_file(gtfs, fl);
+		bench_remove_dir(dir);
+	}
+}
+
+// latency of a logical update of 32 scattered 64-byte slots of a file: a
+// write and sync per slot, or one vectored write of them all
+static void bench_scatter() {
+	for (int vectored = 0; vectored < 2; vectored++) {
+		string dir = bench_dir("scatter");
+		gtfs_t* gtfs = gtfs_init(dir, 0);
+		int length = 1024 * 1024, slots = 32;
+		file_t* fl = gtfs_open_file(gtfs, "file", length);
+		char slot[64];
+		memset(slot, 's', sizeof(slot));
+		vector<gtfs_iovec_t> iov(slots);
+		vector<double> samples;
+		double start = now_us();
+		for (int i = 0; i < 500 * scale; i++) {
+			for (int k = 0; k < slots; k++) {
+				iov[k].offset = (rand() % (length / 64)) * 64;
+				iov[k].length = 64;
+				iov[k].buf = slot;
+			}
+			double t = now_us();
+			if (vectored) {
+				gtfs_sync_write_file(gtfs_writev_file(gtfs, fl, &iov[0], slots));
+			} else {
+				for (int k = 0; k < slots; k++) gtfs_sync_write_file(gtfs_write_file(gtfs, fl, iov[k].offset, 64, slot));
+			}
+			samples.push_back(now_us() - t);
+		}
+		report("scatter", vectored ? "api=writev" : "api=write", samples, now_us() - start, (double) samples.size() * slots * 64);
+		gtfs_close_file(gtfs, fl);
+		bench_remove_dir(dir);
+	}
+}
+
+// latency of removing a file with a few records, with the log holding many
+// records of other files
+static void bench_remove() {
+	int sizes[] = { 0, 1000, 10000 };
+	for (int s = 0; s < 3; s++) {
+		string dir = bench_dir("remove");
+		gtfs_t* gtfs = gtfs_init(dir, 0);
+		fill_log(gtfs, "other", sizes[s] * scale, 256);
+		vector<double> samples;
+		double start = now_us();
+		for (int i = 0; i < 50 * scale; i++) {
+			file_t* fl = gtfs_open_file(gtfs, "victim", 4096);
+			gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 8, "contents"));
+			gtfs_close_file(gtfs, fl);
+			double t = now_us();
+			gtfs_remove_file(gtfs, fl);
+			samples.push_back(now_us() - t);
+		}
+		stringstream param;
+		param << "log_records=" << sizes[s] * scale;
+		report("remove", param.str(), samples, now_us() - start, 0);
+		bench_remove_dir(dir);
+	}
+}
+
+// time of a checkpoint (gtfs_clean) by number of records in the log, spread
+// over a few files, applied by one or more threads
+static void bench_clean() {
+	int counts[] = { 100, 1000, 10000 };
+	int threads[] = { 1, 4 };
+	for (int c = 0; c < 3; c++) {
+		for (int t = 0; t < 2; t++) {
+			vector<double> samples;
+			double wall = 0;
+			for (int r = 0; r < 3; r++) {
+				string dir = bench_dir("clean");
+				gtfs_t* gtfs = gtfs_init(dir, 0, GTFS_DATA_COPY, threads[t]);
+				for (int f = 0; f < 4; f++) {
+					stringstream ss;
+					ss << "file" << f;
+					fill_log(gtfs, ss.str(), counts[c] * scale / 4, 1024);
+				}
+				double t0 = now_us();
+				gtfs_clean(gtfs);
+				samples.push_back(now_us() - t0);
+				wall += samples.back();
+				bench_remove_dir(dir);
+			}
+			stringstream param;
+			param << "log_records=" << counts[c] * scale << " threads=" << threads[t];
+			report("clean", param.str(), samples, wall, 0);
+		}
+	}
+}
+
+// time of the first gtfs_init after a process died with records in the log
+// and the shared control block is gone, by number of records; with and
+// without the log index
+static void bench_recovery() {
+	int counts[] = { 1000, 10000 };
+	int threads[] = { 1, 4 };
+	for (int c = 0; c < 2; c++) {
+		// with the index lost, every record is verified, by one or more threads
+		for (int k = 0; k < 3; k++) {
+			bool with_idx = k == 0;
+			int nthreads = threads[k == 0 ? 1 : k - 1];
+			vector<double> samples;
+			double wall = 0;
+			for (int r = 0; r < 3; r++) {
+				string dir = bench_dir("recovery");
+				int pid = fork();
+				if (pid == 0) {
+					gtfs_t* gtfs = gtfs_init(dir, 0);
+					fill_log(gtfs, "file", counts[c] * scale, 1024);
+					// crash without a clean()
+					kill(getpid(), SIGKILL);
+				}
+				waitpid(pid, NULL, 0);
+				bench_drop_ipc(dir);
+				if (!with_idx) remove((dir + "/log.idx").c_str());
+				double t = now_us();
+				gtfs_t* gtfs = gtfs_init(dir, 0, GTFS_DATA_COPY, nthreads);
+				samples.push_back(now_us() - t);
+				wall += samples.back();
+				file_t* fl = gtfs_open_file(gtfs, "file", 1024);
+				gtfs_close_file(gtfs, fl);
+				bench_remove_dir(dir);
+			}
+			stringstream param;
+			param << "log_records=" << counts[c] * scale << " index=" << (with_idx ? "kept" : "lost") << " threads=" << nthreads;
+			report("recovery", param.str(), samples, wall, 0);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	if (argc >= 2) scale = max(1L, strtol(argv[1], NULL, 10));
+
+	char cwd[256];
+	if (getcwd(cwd, sizeof(cwd)) != NULL) {
+		directory = string(cwd);
+	} else {
+		cout << "[cwd] Something went wrong.\n";
+		return 1;
+	}
+
+	printf("benchmark,param,ops,p50_us,p90_us,p99_us,max_us,ops_per_sec,mb_per_sec\n");
+	bench_open();
+	bench_sync();
+	bench_read();
+	bench_scatter();
+	bench_remove();
+	bench_clean();
+	bench_recovery();
+	return 0;
+}
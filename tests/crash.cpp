@@ -0,0 +1,259 @@
+#include "../gtfs.hpp"
+
+// Crash-injection harness. Every round forks workers that run random
+// write/sync/abort/remove/clean sequences on their own files, kills them all
+// with SIGKILL at a random point, and then has a fresh process recover the
+// directory and compare every file against a reference model of what was
+// acknowledged. Workers report each operation to the harness through a pipe
+// before starting it and again once it returned, so a killed operation may or
+// may not have reached the disk, but nothing acknowledged may be lost.
+// Every other round also drops the directory's shared memory and semaphores,
+// as a reboot would, so that gtfs_init runs a full recovery.
+// Usage: ./crash [rounds] [seed]; exits with 1 if any round failed.
+
+#define CRASH_WORKERS 3
+#define CRASH_FILES 3 // per worker
+#define CRASH_FILE_SIZE 8192
+#define CRASH_MAX_WRITE 512
+#define CRASH_MAX_DELAY_US 40000 // how long the workers run before they are killed
+
+#define MSG_WRITE 1 // about to sync a write of data
+#define MSG_REMOVE 2 // about to remove the file
+#define MSG_DONE 3 // the operation announced last returned successfully
+
+struct crash_msg {
+	int kind;
+	int file;
+	int offset;
+	int length;
+	char data[CRASH_MAX_WRITE];
+};
+
+string directory;
+
+static double now_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static string crash_filename(int worker, int file) {
+	stringstream ss;
+	ss << "crash" << worker << "_" << file;
+	return ss.str();
+}
+
+// the whole message fits in one pipe write, so it is never torn by a kill
+static void send_msg(int fd, const crash_msg& msg) {
+	if (write(fd, &msg, sizeof(msg)) != sizeof(msg)) _exit(2);
+}
+
+static void worker(int id, int fd, unsigned seed) {
+	srand(seed);
+	gtfs_t* gtfs = gtfs_init(directory, 0);
+	if (gtfs == NULL) _exit(2);
+	gtfs->checkpoint_threshold = 64 * 1024;
+	file_t* files[CRASH_FILES];
+	for (int f = 0; f < CRASH_FILES; f++) files[f] = gtfs_open_file(gtfs, crash_filename(id, f), CRASH_FILE_SIZE);
+	for (;;) {
+		crash_msg msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.file = rand() % CRASH_FILES;
+		int op = rand() % 100;
+		if (op < 80) {
+			msg.length = 1 + rand() % CRASH_MAX_WRITE;
+			msg.offset = rand() % (CRASH_FILE_SIZE - msg.length + 1);
+			for (int i = 0; i < msg.length; i++) msg.data[i] = 'a' + rand() % 26;
+			write_t* wrt = gtfs_write_file(gtfs, files[msg.file], msg.offset, msg.length, msg.data);
+			if (op < 65) {
+				msg.kind = MSG_WRITE;
+				send_msg(fd, msg);
+				if (gtfs_sync_write_file(wrt) != msg.length) continue;
+			} else {
+				// never reaches the log
+				gtfs_abort_write_file(wrt);
+				continue;
+			}
+		} else if (op < 85) {
+			msg.kind = MSG_REMOVE;
+			send_msg(fd, msg);
+			gtfs_close_file(gtfs, files[msg.file]);
+			int ret = gtfs_remove_file(gtfs, files[msg.file]);
+			files[msg.file] = gtfs_open_file(gtfs, crash_filename(id, msg.file), CRASH_FILE_SIZE);
+			if (ret != 0) continue;
+		} else if (op < 90) {
+			gtfs_clean(gtfs);
+			continue;
+		} else {
+			usleep(rand() % 500);
+			continue;
+		}
+		crash_msg done;
+		memset(&done, 0, sizeof(done));
+		done.kind = MSG_DONE;
+		done.file = msg.file;
+		send_msg(fd, done);
+	}
+}
+
+// the reference model: the acknowledged content of every file, and per
+// worker the operation that was in flight when it was killed
+struct crash_model {
+	string files[CRASH_WORKERS][CRASH_FILES];
+	bool pending[CRASH_WORKERS];
+	crash_msg last[CRASH_WORKERS];
+};
+
+static void model_apply(string& image, const crash_msg& msg) {
+	if (msg.kind == MSG_WRITE) {
+		image.replace(msg.offset, msg.length, msg.data, msg.length);
+	} else if (msg.kind == MSG_REMOVE) {
+		image.assign(CRASH_FILE_SIZE, '\0');
+	}
+}
+
+// read what a killed worker managed to report
+static void drain(int fd, crash_model& model, int w) {
+	crash_msg msg;
+	while (read(fd, &msg, sizeof(msg)) == sizeof(msg)) {
+		if (msg.kind == MSG_DONE) {
+			if (model.pending[w]) model_apply(model.files[w][model.last[w].file], model.last[w]);
+			model.pending[w] = false;
+		} else {
+			model.last[w] = msg;
+			model.pending[w] = true;
+		}
+	}
+}
+
+// recover the directory in a fresh process and check every file against the
+// model; the in-flight operation of a worker may show or not. Reports the
+// recovery time and which in-flight operations showed through fd.
+static void verify(crash_model& model, int fd) {
+	double start = now_us();
+	gtfs_t* gtfs = gtfs_init(directory, 0);
+	double recovery_us = now_us() - start;
+	int result[1 + CRASH_WORKERS];
+	memset(result, 0, sizeof(result));
+	result[0] = (int) recovery_us;
+	bool ok = gtfs != NULL;
+	for (int w = 0; w < CRASH_WORKERS && ok; w++) {
+		for (int f = 0; f < CRASH_FILES; f++) {
+			file_t* fl = gtfs_open_file(gtfs, crash_filename(w, f), CRASH_FILE_SIZE);
+			char* data = gtfs_read_file(gtfs, fl, 0, CRASH_FILE_SIZE);
+			string image(data, CRASH_FILE_SIZE);
+			delete[] data;
+			gtfs_close_file(gtfs, fl);
+			if (image == model.files[w][f]) continue;
+			if (model.pending[w] && model.last[w].file == f) {
+				string with = model.files[w][f];
+				model_apply(with, model.last[w]);
+				if (image == with) {
+					result[1 + w] = 1;
+					continue;
+				}
+			}
+			size_t diff = 0;
+			while (image[diff] == model.files[w][f][diff]) diff++;
+			printf("  %s differs from the model at offset %zu (in flight: %s)\n", crash_filename(w, f).c_str(), diff,
+				!model.pending[w] ? "nothing" : model.last[w].kind == MSG_WRITE ? "write" : "remove");
+			ok = false;
+		}
+	}
+	fflush(stdout);
+	if (write(fd, result, sizeof(result)) != sizeof(result)) _exit(2);
+	_exit(ok ? 0 : 1);
+}
+
+static void drop_ipc() {
+	int shm_id = shmget(ftok(directory.c_str(), 1), 0, 0666);
+	if (shm_id != -1) shmctl(shm_id, IPC_RMID, NULL);
+	for (int k = 1; k <= 2; k++) {
+		int sem_id = semget(ftok(directory.c_str(), k), 1, 0666);
+		if (sem_id != -1) semctl(sem_id, 0, IPC_RMID);
+	}
+}
+
+int main(int argc, char **argv) {
+	int rounds = argc >= 2 ? atoi(argv[1]) : 50;
+	unsigned seed = argc >= 3 ? strtoul(argv[2], NULL, 10) : time(NULL);
+	srand(seed);
+
+	char cwd[256];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		cout << "[cwd] Something went wrong.\n";
+		return 1;
+	}
+	stringstream ss;
+	ss << cwd << "/crash." << getpid();
+	directory = ss.str();
+	mkdir(directory.c_str(), S_IRWXU);
+	printf("directory %s, seed %u\n", directory.c_str(), seed);
+	// before the first fork, or every child prints it again
+	fflush(stdout);
+
+	crash_model model;
+	for (int w = 0; w < CRASH_WORKERS; w++) {
+		for (int f = 0; f < CRASH_FILES; f++) model.files[w][f].assign(CRASH_FILE_SIZE, '\0');
+		model.pending[w] = false;
+	}
+	int failed = 0;
+	vector<double> recovery;
+	for (int round = 0; round < rounds; round++) {
+		pid_t pids[CRASH_WORKERS];
+		int fds[CRASH_WORKERS];
+		for (int w = 0; w < CRASH_WORKERS; w++) {
+			int p[2];
+			if (pipe(p) == -1) return 1;
+			unsigned worker_seed = rand();
+			pids[w] = fork();
+			if (pids[w] == 0) {
+				close(p[0]);
+				worker(w, p[1], worker_seed);
+			}
+			close(p[1]);
+			fds[w] = p[0];
+		}
+		usleep(rand() % CRASH_MAX_DELAY_US);
+		for (int w = 0; w < CRASH_WORKERS; w++) kill(pids[w], SIGKILL);
+		for (int w = 0; w < CRASH_WORKERS; w++) {
+			waitpid(pids[w], NULL, 0);
+			drain(fds[w], model, w);
+			close(fds[w]);
+		}
+		if (round % 2 == 1) drop_ipc();
+
+		int p[2];
+		if (pipe(p) == -1) return 1;
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(p[0]);
+			verify(model, p[1]);
+		}
+		close(p[1]);
+		int result[1 + CRASH_WORKERS];
+		bool reported = read(p[0], result, sizeof(result)) == sizeof(result);
+		close(p[0]);
+		int status;
+		waitpid(pid, &status, 0);
+		if (!reported || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			printf("round %d: FAIL (%s %d)\n", round, WIFEXITED(status) ? "exit" : "signal", WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+			failed++;
+			break;
+		}
+		recovery.push_back(result[0]);
+		// an in-flight operation that made it is part of the model from now on
+		for (int w = 0; w < CRASH_WORKERS; w++) {
+			if (model.pending[w] && result[1 + w]) model_apply(model.files[w][model.last[w].file], model.last[w]);
+			model.pending[w] = false;
+		}
+	}
+	drop_ipc();
+	if (!recovery.empty()) {
+		sort(recovery.begin(), recovery.end());
+		printf("recovery_us p50=%.0f p99=%.0f max=%.0f\n", recovery[recovery.size() / 2], recovery[recovery.size() * 99 / 100], recovery.back());
+	}
+	printf("%d rounds, %d failed\n", (int) recovery.size() + failed, failed);
+	if (failed == 0) system(("rm -rf " + directory).c_str());
+	return failed ? 1 : 0;
+}
@@ -1,8 +1,10 @@
 #include "../gtfs.hpp"
+#include <sys/resource.h> // setrlimit, to make log appends fail
 
 // Assumes files are located within the current directory
 string directory;
 int verbose;
+int big_files; // also run the checks that hold files of several GB in memory
 
 // **Test 1**: Testing that data written by one process is then successfully read by another process.
 void writer() {
@@ -60,10 +62,13 @@ void test_abort_write() {
 	gtfs_sync_write_file(wrt1);
 	
 	write_t *wrt2 = gtfs_write_file(gtfs, fl, 20, str.length(), str.c_str());
-	gtfs_abort_write_file(wrt2);
+	int aborted = gtfs_abort_write_file(wrt2);
 	
 	char *data1 = gtfs_read_file(gtfs, fl, 0, str.length());
-	if (data1 != NULL) { 
+	if (aborted != 0) {
+		// On success, aborting returns 0
+		cout << FAIL;
+	} else if (data1 != NULL) { 
 		// First write was synced so reading should be successfull
 		if (str.compare(string(data1)) != 0) {
 			cout << FAIL;
@@ -133,11 +138,1196 @@ void test_remove_file() {
 	gtfs_close_file(gtfs, fl2);
 }
 
+// **Test 5**: Testing that concurrent syncs from several threads are all persisted by group commit.
+#define GC_THREADS 8
+#define GC_WRITES 16
+
+struct gc_arg {
+	gtfs_t *gtfs;
+	file_t *fl;
+	int id;
+};
+
+void* gc_syncer(void* arg) {
+	gc_arg *a = (gc_arg*) arg;
+	for (int i = 0; i < GC_WRITES; i++) {
+		char c = 'a' + a->id;
+		write_t *wrt = gtfs_write_file(a->gtfs, a->fl, a->id * GC_WRITES + i, 1, &c);
+		gtfs_sync_write_file(wrt);
+	}
+	return NULL;
+}
+
+void test_group_commit() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	gtfs->commit_max_wait_us = 1000;
+	string filename = "test4.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, GC_THREADS * GC_WRITES);
+
+	pthread_t threads[GC_THREADS];
+	gc_arg args[GC_THREADS];
+	for (int t = 0; t < GC_THREADS; t++) {
+		args[t].gtfs = gtfs;
+		args[t].fl = fl;
+		args[t].id = t;
+		pthread_create(&threads[t], NULL, gc_syncer, &args[t]);
+	}
+	for (int t = 0; t < GC_THREADS; t++) pthread_join(threads[t], NULL);
+	gtfs_close_file(gtfs, fl);
+
+	// a fresh process replays the log and must see every synced byte
+	cout.flush();
+	int pid = fork();
+	if (pid == 0) {
+		gtfs_t *gtfs2 = gtfs_init(directory, verbose);
+		file_t *fl2 = gtfs_open_file(gtfs2, filename, GC_THREADS * GC_WRITES);
+		char *data = gtfs_read_file(gtfs2, fl2, 0, GC_THREADS * GC_WRITES);
+		bool ok = data != NULL;
+		for (int t = 0; ok && t < GC_THREADS; t++) {
+			for (int i = 0; i < GC_WRITES; i++) {
+				if (data[t * GC_WRITES + i] != 'a' + t) ok = false;
+			}
+		}
+		ok ? cout << PASS : cout << FAIL;
+		gtfs_close_file(gtfs2, fl2);
+		exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+// **Test 6**: Testing that a missing log index is rebuilt from the log.
+
+void test_log_index() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test5.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, 100);
+	string str = "Indexed string.\n";
+	write_t *wrt = gtfs_write_file(gtfs, fl, 30, str.length(), str.c_str());
+	gtfs_sync_write_file(wrt);
+	gtfs_close_file(gtfs, fl);
+
+	remove((directory + "/log.idx").c_str());
+	cout.flush();
+	int pid = fork();
+	if (pid == 0) {
+		gtfs_t *gtfs2 = gtfs_init(directory, verbose);
+		file_t *fl2 = gtfs_open_file(gtfs2, filename, 100);
+		char *data = gtfs_read_file(gtfs2, fl2, 30, str.length());
+		(data != NULL && memcmp(data, str.c_str(), str.length()) == 0) ? cout << PASS : cout << FAIL;
+		gtfs_close_file(gtfs2, fl2);
+		exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+// **Test 7**: Testing that a memory-mapped file sees synced log records and aborts correctly.
+
+void test_mmap_file() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test6.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, 10000);
+	string str = "Mapped string.\n";
+	write_t *wrt = gtfs_write_file(gtfs, fl, 5000, str.length(), str.c_str());
+	gtfs_sync_write_file(wrt);
+	gtfs_close_file(gtfs, fl);
+
+	gtfs_t *gtfs2 = gtfs_init(directory, verbose, GTFS_DATA_MMAP);
+	file_t *fl2 = gtfs_open_file(gtfs2, filename, 10000);
+	write_t *wrt2 = gtfs_write_file(gtfs2, fl2, 5000, 6, "Broken");
+	gtfs_abort_write_file(wrt2);
+	char *data = gtfs_read_file(gtfs2, fl2, 5000, str.length());
+	(data != NULL && memcmp(data, str.c_str(), str.length()) == 0) ? cout << PASS : cout << FAIL;
+	gtfs_close_file(gtfs2, fl2);
+}
+
+// **Test 8**: Testing that views and caller-buffer reads return the file contents without copies.
+
+void test_read_view() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test7.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, 100);
+	string str = "Viewed string.\n";
+	write_t *wrt = gtfs_write_file(gtfs, fl, 40, str.length(), str.c_str());
+	gtfs_sync_write_file(wrt);
+
+	gtfs_view_t view = gtfs_read_view(gtfs, fl, 40, str.length());
+	char buf[100];
+	int n = gtfs_read_file_into(gtfs, fl, 40, str.length(), buf);
+	gtfs_view_t bad = gtfs_read_view(gtfs, fl, 90, 20);
+	if (view.data != NULL && view.length == (int) str.length() && memcmp(view.data, str.c_str(), str.length()) == 0
+			&& n == (int) str.length() && memcmp(buf, str.c_str(), str.length()) == 0 && bad.data == NULL) {
+		cout << PASS;
+	} else {
+		cout << FAIL;
+	}
+	gtfs_close_file(gtfs, fl);
+}
+
+// **Test 9**: Testing that a background checkpoint applies overlapping writes in order.
+
+void test_checkpoint() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	gtfs_clean(gtfs);
+	string filename = "test8.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, 100);
+	write_t *wrt1 = gtfs_write_file(gtfs, fl, 0, 10, "AAAAAAAAAA");
+	gtfs_sync_write_file(wrt1);
+	write_t *wrt2 = gtfs_write_file(gtfs, fl, 3, 4, "BBBB");
+	gtfs_sync_write_file(wrt2);
+	gtfs->checkpoint_threshold = 1;
+	write_t *wrt3 = gtfs_write_file(gtfs, fl, 8, 4, "CCCC");
+	gtfs_sync_write_file(wrt3);
+
+	// wait for the background checkpointer to write the file
+	char buf[12];
+	int n = 0;
+	for (int i = 0; i < 200; i++) {
+		int fd = open((directory + "/" + filename).c_str(), O_RDONLY);
+		n = read(fd, buf, 12);
+		close(fd);
+		if (n == 12 && memcmp(buf, "AAABBBBACCCC", 12) == 0) break;
+		usleep(10000);
+	}
+	(n == 12 && memcmp(buf, "AAABBBBACCCC", 12) == 0) ? cout << PASS : cout << FAIL;
+	gtfs_close_file(gtfs, fl);
+}
+
+// **Test 10**: Testing that a torn record at the end of the log is detected and dropped.
+
+// path of the last log segment of dir
+string last_log_segment(string dir) {
+	string last;
+	for (int n = 0; n < 4096; n++) {
+		char name[32];
+		snprintf(name, sizeof(name), "/log.%08x", n);
+		struct stat statbuf;
+		if (stat((dir + name).c_str(), &statbuf) == 0) last = dir + name;
+	}
+	return last;
+}
+
+void test_torn_record() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test9.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, 100);
+	string str = "Durable string.\n";
+	write_t *wrt = gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str());
+	gtfs_sync_write_file(wrt);
+	gtfs_close_file(gtfs, fl);
+
+	// simulate a crash in the middle of appending a record
+	int log_fd = open(last_log_segment(directory).c_str(), O_WRONLY | O_APPEND);
+	char garbage[40];
+	memset(garbage, 0x47, sizeof(garbage));
+	write(log_fd, garbage, sizeof(garbage));
+	close(log_fd);
+
+	gtfs_t *gtfs2 = gtfs_init(directory, verbose);
+	file_t *fl2 = gtfs_open_file(gtfs2, filename, 100);
+	string str2 = "After the crash.\n";
+	write_t *wrt2 = gtfs_write_file(gtfs2, fl2, 50, str2.length(), str2.c_str());
+	gtfs_sync_write_file(wrt2);
+	gtfs_close_file(gtfs2, fl2);
+
+	gtfs_t *gtfs3 = gtfs_init(directory, verbose);
+	file_t *fl3 = gtfs_open_file(gtfs3, filename, 100);
+	char *data1 = gtfs_read_file(gtfs3, fl3, 0, str.length());
+	char *data2 = gtfs_read_file(gtfs3, fl3, 50, str2.length());
+	(memcmp(data1, str.c_str(), str.length()) == 0 && memcmp(data2, str2.c_str(), str2.length()) == 0) ? cout << PASS : cout << FAIL;
+	gtfs_close_file(gtfs3, fl3);
+}
+
+// **Test 11**: Testing that a log in the original record format is migrated.
+
+void test_log_migration() {
+	string subdir = directory + "/old_format";
+	mkdir(subdir.c_str(), S_IRWXU);
+	int log_fd = open((subdir + "/log").c_str(), O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+	string filename = "old.txt";
+	string str = "Old format.\n";
+	int filename_length = filename.length(), offset = 20, length = str.length();
+	char valid = 1;
+	write(log_fd, &filename_length, sizeof(int));
+	write(log_fd, filename.c_str(), filename_length);
+	write(log_fd, &offset, sizeof(int));
+	write(log_fd, &length, sizeof(int));
+	write(log_fd, str.c_str(), length);
+	write(log_fd, &valid, 1);
+	close(log_fd);
+
+	gtfs_t *gtfs = gtfs_init(subdir, verbose);
+	file_t *fl = gtfs_open_file(gtfs, filename, 100);
+	char *data = gtfs_read_file(gtfs, fl, 20, str.length());
+	(data != NULL && memcmp(data, str.c_str(), str.length()) == 0) ? cout << PASS : cout << FAIL;
+	gtfs_close_file(gtfs, fl);
+}
+
+// **Test 12**: Testing that one gtfs_t and its files can be used by many threads at once.
+#define MT_THREADS 4
+#define MT_PAGES 16
+
+struct mt_arg {
+	gtfs_t *gtfs;
+	file_t *shared;
+	int id;
+	bool ok;
+};
+
+void* mt_worker(void* arg) {
+	mt_arg *a = (mt_arg*) arg;
+	stringstream ss;
+	ss << "test12_" << a->id << ".txt";
+	file_t *fl = gtfs_open_file(a->gtfs, ss.str(), 4096);
+	for (int i = 0; i < 32; i++) {
+		char c = 'a' + i % 26;
+		write_t *wrt = gtfs_write_file(a->gtfs, fl, i * 64, 64, string(64, c).c_str());
+		gtfs_sync_write_file(wrt);
+	}
+	for (int i = 0; i < 32; i++) {
+		char buf[64];
+		gtfs_read_file_into(a->gtfs, fl, i * 64, 64, buf);
+		if (buf[0] != 'a' + i % 26 || buf[63] != 'a' + i % 26) a->ok = false;
+	}
+	gtfs_close_file(a->gtfs, fl);
+	// every thread faults in the pages of the shared mmap-backed file
+	for (int p = 0; p < MT_PAGES; p++) {
+		int page = (p + a->id) % MT_PAGES;
+		char buf[8];
+		gtfs_read_file_into(a->gtfs, a->shared, page * 4096, 8, buf);
+		if (memcmp(buf, "PAGEDATA", 8) != 0) a->ok = false;
+	}
+	return NULL;
+}
+
+void test_multithreaded() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test11.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, MT_PAGES * 4096);
+	for (int p = 0; p < MT_PAGES; p++) {
+		write_t *wrt = gtfs_write_file(gtfs, fl, p * 4096, 8, "PAGEDATA");
+		gtfs_sync_write_file(wrt);
+	}
+	gtfs_close_file(gtfs, fl);
+
+	gtfs_t *gtfs2 = gtfs_init(directory, verbose, GTFS_DATA_MMAP);
+	file_t *shared = gtfs_open_file(gtfs2, filename, MT_PAGES * 4096);
+	pthread_t threads[MT_THREADS];
+	mt_arg args[MT_THREADS];
+	for (int t = 0; t < MT_THREADS; t++) {
+		args[t].gtfs = gtfs2;
+		args[t].shared = shared;
+		args[t].id = t;
+		args[t].ok = true;
+		pthread_create(&threads[t], NULL, mt_worker, &args[t]);
+	}
+	bool ok = true;
+	for (int t = 0; t < MT_THREADS; t++) {
+		pthread_join(threads[t], NULL);
+		ok = ok && args[t].ok;
+	}
+	ok ? cout << PASS : cout << FAIL;
+	gtfs_close_file(gtfs2, shared);
+}
+
+// **Test 13**: Testing that processes appending to one log at once all persist their records, and that records of killed appenders never show up later.
+
+#define MP_PROCS 4
+#define MP_WRITES 50
+#define MP_KILL_ROUNDS 10
+
+// drop the directory's shared memory and semaphores, as a reboot would
+void drop_ipc(string dir = directory) {
+	int shm_id = shmget(ftok(dir.c_str(), 1), 0, 0666);
+	if (shm_id != -1) shmctl(shm_id, IPC_RMID, NULL);
+	for (int k = 1; k <= 2; k++) {
+		int sem_id = semget(ftok(dir.c_str(), k), 1, 0666);
+		if (sem_id != -1) semctl(sem_id, 0, IPC_RMID);
+	}
+}
+
+// the content of the files of killed appenders, as a new gtfs_t reads them
+string mp_killed_content() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string content;
+	for (int p = 0; p < 2; p++) {
+		file_t *fl = gtfs_open_file(gtfs, "test13_kill" + to_string(p), MP_WRITES);
+		char *data = gtfs_read_file(gtfs, fl, 0, MP_WRITES);
+		content += string(data, MP_WRITES);
+		gtfs_close_file(gtfs, fl);
+	}
+	return content;
+}
+
+void test_multiprocess_append() {
+	cout.flush();
+	int pids[MP_PROCS];
+	for (int p = 0; p < MP_PROCS; p++) {
+		pids[p] = fork();
+		if (pids[p] == 0) {
+			gtfs_t *gtfs = gtfs_init(directory, verbose);
+			file_t *fl = gtfs_open_file(gtfs, "test13_" + to_string(p), MP_WRITES);
+			for (int i = 0; i < MP_WRITES; i++) {
+				char c = 'a' + p;
+				write_t *wrt = gtfs_write_file(gtfs, fl, i, 1, &c);
+				gtfs_sync_write_file(wrt);
+			}
+			gtfs_close_file(gtfs, fl);
+			exit(0);
+		}
+	}
+	for (int p = 0; p < MP_PROCS; p++) waitpid(pids[p], NULL, 0);
+
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	bool ok = true;
+	for (int p = 0; p < MP_PROCS; p++) {
+		string filename = "test13_" + to_string(p);
+		int open_handles = -1, log_records = -1;
+		gtfs_get_file_info(gtfs, filename, &open_handles, &log_records);
+		if (open_handles != 0 || log_records != MP_WRITES) ok = false;
+		file_t *fl = gtfs_open_file(gtfs, filename, MP_WRITES);
+		gtfs_get_file_info(gtfs, filename, &open_handles, &log_records);
+		if (open_handles != 1) ok = false;
+		char *data = gtfs_read_file(gtfs, fl, 0, MP_WRITES);
+		for (int i = 0; ok && i < MP_WRITES; i++) {
+			if (data[i] != 'a' + p) ok = false;
+		}
+		gtfs_close_file(gtfs, fl);
+	}
+
+	// one appender is stopped, most likely between reserving its region and
+	// publishing it, and the other one queues behind it with its record
+	// written; both are killed. What a process attaching afterwards sees must
+	// be what a full recovery sees: their regions are covered by then.
+	for (int round = 0; round < MP_KILL_ROUNDS && ok; round++) {
+		int kids[2];
+		for (int p = 0; p < 2; p++) {
+			kids[p] = fork();
+			if (kids[p] == 0) {
+				gtfs_t *gtfs2 = gtfs_init(directory, verbose);
+				file_t *fl = gtfs_open_file(gtfs2, "test13_kill" + to_string(p), MP_WRITES);
+				for (int i = 0;; i++) {
+					char c = 'a' + i % 26;
+					gtfs_sync_write_file(gtfs_write_file(gtfs2, fl, i % MP_WRITES, 1, &c));
+				}
+			}
+		}
+		usleep(20000 + rand() % 20000);
+		kill(kids[0], SIGSTOP);
+		usleep(10000);
+		for (int p = 0; p < 2; p++) kill(kids[p], SIGKILL);
+		for (int p = 0; p < 2; p++) waitpid(kids[p], NULL, 0);
+		string attached = mp_killed_content();
+		drop_ipc();
+		remove((directory + "/log.idx").c_str());
+		ok = ok && mp_killed_content() == attached;
+	}
+	ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 14**: Testing that a transaction commits writes to several files as one record, and rolls back.
+
+void test_transaction() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	file_t *fl1 = gtfs_open_file(gtfs, "test14_a", 100);
+	file_t *fl2 = gtfs_open_file(gtfs, "test14_b", 100);
+
+	txn_t *txn = gtfs_begin(gtfs);
+	gtfs_txn_write(txn, fl1, 0, 4, "XXXX");
+	gtfs_txn_write(txn, fl1, 10, 4, "YYYY");
+	gtfs_rollback(txn);
+
+	txn = gtfs_begin(gtfs);
+	gtfs_txn_write(txn, fl1, 0, 4, "AAAA");
+	gtfs_txn_write(txn, fl1, 2, 4, "BBBB");
+	gtfs_txn_write(txn, fl1, 6, 2, "CC");
+	gtfs_txn_write(txn, fl2, 50, 5, "other");
+	int written = gtfs_commit(txn);
+	gtfs_close_file(gtfs, fl1);
+	gtfs_close_file(gtfs, fl2);
+
+	cout.flush();
+	int pid = fork();
+	if (pid == 0) {
+		gtfs_t *gtfs2 = gtfs_init(directory, verbose);
+		int open_handles, log_records;
+		gtfs_get_file_info(gtfs2, "test14_a", &open_handles, &log_records);
+		file_t *fl3 = gtfs_open_file(gtfs2, "test14_a", 100);
+		file_t *fl4 = gtfs_open_file(gtfs2, "test14_b", 100);
+		char *data1 = gtfs_read_file(gtfs2, fl3, 0, 14);
+		char *data2 = gtfs_read_file(gtfs2, fl4, 50, 5);
+		bool ok = written == 13 && log_records == 1;
+		ok = ok && memcmp(data1, "AABBBBCC\0\0\0\0\0\0", 14) == 0 && memcmp(data2, "other", 5) == 0;
+		ok ? cout << PASS : cout << FAIL;
+		gtfs_close_file(gtfs2, fl3);
+		gtfs_close_file(gtfs2, fl4);
+		exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+// **Test 15**: Testing that recycled write descriptors and buffers keep writes of every size intact.
+
+void test_pooled_writes() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test15.txt";
+	int sizes[] = { 1, 64, 65, 4000, 100000 };
+	int file_length = 0;
+	for (int i = 0; i < 5; i++) file_length += sizes[i];
+	file_t *fl = gtfs_open_file(gtfs, filename, file_length);
+	string expected(file_length, '\0');
+	for (int round = 0; round < 3; round++) {
+		int offset = 0;
+		for (int i = 0; i < 5; i++) {
+			string str(sizes[i], 'a' + round + i);
+			write_t *wrt = gtfs_write_file(gtfs, fl, offset, sizes[i], str.c_str());
+			if (round == 1) {
+				// the undo record must come back, even from a recycled buffer
+				gtfs_abort_write_file(wrt);
+			} else {
+				gtfs_sync_write_file(wrt);
+				expected.replace(offset, sizes[i], str);
+			}
+			offset += sizes[i];
+		}
+	}
+	gtfs_close_file(gtfs, fl);
+
+	cout.flush();
+	int pid = fork();
+	if (pid == 0) {
+		gtfs_t *gtfs2 = gtfs_init(directory, verbose);
+		file_t *fl2 = gtfs_open_file(gtfs2, filename, file_length);
+		char *data = gtfs_read_file(gtfs2, fl2, 0, file_length);
+		(data != NULL && memcmp(data, expected.data(), file_length) == 0) ? cout << PASS : cout << FAIL;
+		gtfs_close_file(gtfs2, fl2);
+		exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+// **Test 16**: Testing that a removed file's records stay void after the log index is rebuilt and a checkpoint, also when the file was left behind.
+
+// put back the content of a removed file, as a remove killed after its
+// tombstone was durable but before the file was deleted would leave it
+void leave_behind(string filename, const char *data, int length) {
+	int fd = open((directory + "/" + filename).c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	pwrite(fd, data, length, 0);
+	close(fd);
+}
+
+void test_remove_tombstone() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test16.txt", other = "test16b.txt";
+	file_t *fl = gtfs_open_file(gtfs, other, 100);
+	gtfs_close_file(gtfs, fl);
+	gtfs_remove_file(gtfs, fl);
+	leave_behind(other, "LEFTOVER", 8);
+	fl = gtfs_open_file(gtfs, filename, 100);
+	write_t *wrt = gtfs_write_file(gtfs, fl, 0, 8, "OLDDATA!");
+	gtfs_sync_write_file(wrt);
+	gtfs_close_file(gtfs, fl);
+	gtfs_remove_file(gtfs, fl);
+	leave_behind(filename, "OLDDATA!", 8);
+
+	fl = gtfs_open_file(gtfs, filename, 100);
+	wrt = gtfs_write_file(gtfs, fl, 4, 3, "new");
+	gtfs_sync_write_file(wrt);
+	gtfs_close_file(gtfs, fl);
+
+	// the index is rebuilt from the log, where only the tombstone remembers the remove
+	remove((directory + "/log.idx").c_str());
+	cout.flush();
+	int pid = fork();
+	if (pid == 0) {
+		gtfs_t *gtfs2 = gtfs_init(directory, verbose);
+		file_t *fl2 = gtfs_open_file(gtfs2, filename, 100);
+		char *data = gtfs_read_file(gtfs2, fl2, 0, 8);
+		bool ok = memcmp(data, "\0\0\0\0new\0", 8) == 0;
+		gtfs_close_file(gtfs2, fl2);
+		gtfs_clean(gtfs2);
+		fl2 = gtfs_open_file(gtfs2, filename, 100);
+		data = gtfs_read_file(gtfs2, fl2, 0, 8);
+		ok = ok && memcmp(data, "\0\0\0\0new\0", 8) == 0;
+		// the checkpoint cleared the file left behind that nobody opened
+		char buf[8];
+		int fd = open((directory + "/" + other).c_str(), O_RDONLY);
+		ok = ok && pread(fd, buf, 8, 0) == 8 && memcmp(buf, "\0\0\0\0\0\0\0\0", 8) == 0;
+		close(fd);
+		ok ? cout << PASS : cout << FAIL;
+		gtfs_close_file(gtfs2, fl2);
+		exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+// **Test 17**: Testing that background compaction deletes checkpointed log segments while writes go on.
+
+#define SEG_WRITES 40
+#define SEG_WRITE_SIZE (512 * 1024)
+
+void test_log_segments() {
+	string subdir = directory + "/segments";
+	mkdir(subdir.c_str(), S_IRWXU);
+	gtfs_t *gtfs = gtfs_init(subdir, verbose);
+	gtfs->checkpoint_threshold = 4 * SEG_WRITE_SIZE;
+	string filename = "test17.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, SEG_WRITES * SEG_WRITE_SIZE);
+	// more than one segment's worth of records
+	for (int i = 0; i < SEG_WRITES; i++) {
+		string str(SEG_WRITE_SIZE, 'a' + i % 26);
+		write_t *wrt = gtfs_write_file(gtfs, fl, i * SEG_WRITE_SIZE, str.length(), str.c_str());
+		gtfs_sync_write_file(wrt);
+	}
+	gtfs_close_file(gtfs, fl);
+	// the first segment is sealed and goes once a checkpoint moves past it
+	struct stat statbuf;
+	bool deleted = false;
+	for (int i = 0; i < 500 && !deleted; i++) {
+		deleted = stat((subdir + "/log.00000000").c_str(), &statbuf) == -1;
+		if (!deleted) usleep(10000);
+	}
+
+	cout.flush();
+	int pid = fork();
+	if (pid == 0) {
+		gtfs_t *gtfs2 = gtfs_init(subdir, verbose);
+		file_t *fl2 = gtfs_open_file(gtfs2, filename, SEG_WRITES * SEG_WRITE_SIZE);
+		bool ok = deleted;
+		for (int i = 0; i < SEG_WRITES && ok; i++) {
+			char *data = gtfs_read_file(gtfs2, fl2, i * SEG_WRITE_SIZE, SEG_WRITE_SIZE);
+			ok = data != NULL && data[0] == 'a' + i % 26 && data[SEG_WRITE_SIZE - 1] == 'a' + i % 26;
+		}
+		ok ? cout << PASS : cout << FAIL;
+		gtfs_close_file(gtfs2, fl2);
+		exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+// **Test 18**: Testing that flushing a file writes only the bytes of its synced writes, and never writes that failed to sync.
+
+void test_flush_dirty_pages() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test18.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, 16 * 4096);
+	write_t *wrt1 = gtfs_write_file(gtfs, fl, 2 * 4096, 6, "synced");
+	gtfs_sync_write_file(wrt1);
+	write_t *wrt2 = gtfs_write_file(gtfs, fl, 9 * 4096 + 4090, 12, "spans 2 page");
+	gtfs_sync_write_file(wrt2);
+	write_t *wrt3 = gtfs_write_file(gtfs, fl, 5 * 4096, 7, "pending");
+	int first = gtfs_flush_file(gtfs, fl);
+
+	char buf[12];
+	int fd = open((directory + "/" + filename).c_str(), O_RDONLY);
+	bool ok = first == 3;
+	ok = ok && pread(fd, buf, 6, 2 * 4096) == 6 && memcmp(buf, "synced", 6) == 0;
+	ok = ok && pread(fd, buf, 12, 9 * 4096 + 4090) == 12 && memcmp(buf, "spans 2 page", 12) == 0;
+	ok = ok && pread(fd, buf, 7, 5 * 4096) == 7 && memcmp(buf, "\0\0\0\0\0\0\0", 7) == 0;
+	gtfs_sync_write_file(wrt3);
+	int second = gtfs_flush_file(gtfs, fl);
+	ok = ok && second == 1 && pread(fd, buf, 7, 5 * 4096) == 7 && memcmp(buf, "pending", 7) == 0;
+	ok = ok && gtfs_flush_file(gtfs, fl) == 0;
+	close(fd);
+	gtfs_close_file(gtfs, fl);
+
+	// not the rest of their pages: it may be older than what another process
+	// checkpointed to the file since it was opened here
+	string filename2 = "test18b.txt";
+	fl = gtfs_open_file(gtfs, filename2, 4096);
+	cout.flush();
+	int other = fork();
+	if (other == 0) {
+		gtfs_t *gtfs2 = gtfs_init(directory, verbose);
+		file_t *fl2 = gtfs_open_file(gtfs2, filename2, 4096);
+		gtfs_sync_write_file(gtfs_write_file(gtfs2, fl2, 0, 5, "other"));
+		gtfs_close_file(gtfs2, fl2);
+		gtfs_clean(gtfs2);
+		exit(0);
+	}
+	waitpid(other, NULL, 0);
+	gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 100, 4, "mine"));
+	ok = ok && gtfs_flush_file(gtfs, fl) == 1;
+	fd = open((directory + "/" + filename2).c_str(), O_RDONLY);
+	ok = ok && pread(fd, buf, 5, 0) == 5 && memcmp(buf, "other", 5) == 0;
+	ok = ok && pread(fd, buf, 4, 100) == 4 && memcmp(buf, "mine", 4) == 0;
+	close(fd);
+	gtfs_close_file(gtfs, fl);
+
+	// a write or transaction whose record cannot be appended is undone, and
+	// never flushed: here no file may be written past its first byte for a while
+	string subdir = directory + "/nospace";
+	mkdir(subdir.c_str(), S_IRWXU);
+	cout.flush();
+	int pid = fork();
+	if (pid == 0) {
+		gtfs_t *gtfs2 = gtfs_init(subdir, verbose);
+		fl = gtfs_open_file(gtfs2, filename, 4096);
+		signal(SIGXFSZ, SIG_IGN);
+		struct rlimit limit;
+		getrlimit(RLIMIT_FSIZE, &limit);
+		rlim_t max_size = limit.rlim_cur;
+		limit.rlim_cur = 1;
+		setrlimit(RLIMIT_FSIZE, &limit);
+		ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs2, fl, 0, 6, "failed")) == -1;
+		txn_t *txn = gtfs_begin(gtfs2);
+		gtfs_txn_write(txn, fl, 100, 6, "failed");
+		ok = ok && gtfs_commit(txn) == -1;
+		limit.rlim_cur = max_size;
+		setrlimit(RLIMIT_FSIZE, &limit);
+		gtfs_flush_file(gtfs2, fl);
+		char *data = gtfs_read_file(gtfs2, fl, 0, 4096);
+		ok = ok && string(data, 4096) == string(4096, '\0');
+		delete[] data;
+		fd = open((subdir + "/" + filename).c_str(), O_RDONLY);
+		ok = ok && pread(fd, buf, 12, 0) == 12 && memcmp(buf, "\0\0\0\0\0\0\0\0\0\0\0\0", 12) == 0;
+		ok = ok && pread(fd, buf, 6, 100) == 6 && memcmp(buf, "\0\0\0\0\0\0", 6) == 0;
+		close(fd);
+		// the log regions of the failed appends could not be padded either: a
+		// later write is acknowledged only once they are, so a recovery from the
+		// log past them still finds it
+		ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs2, fl, 200, 7, "durable")) == 7;
+		drop_ipc(subdir);
+		remove((subdir + "/log.idx").c_str());
+		gtfs_t *gtfs3 = gtfs_init(subdir, verbose);
+		fl = gtfs_open_file(gtfs3, filename, 4096);
+		data = gtfs_read_file(gtfs3, fl, 200, 7);
+		ok = ok && data != NULL && string(data, 7) == "durable";
+		delete[] data;
+		ok ? cout << PASS : cout << FAIL;
+		exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+// **Test 19**: Testing that asynchronous syncs call back once their records are durable.
+
+#define ASYNC_WRITES 32
+
+struct async_state {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int completed;
+	int bytes;
+};
+
+void async_done(void* arg, ssize_t ret) {
+	async_state *st = (async_state*) arg;
+	pthread_mutex_lock(&st->lock);
+	st->completed++;
+	if (ret > 0) st->bytes += ret;
+	pthread_cond_signal(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+}
+
+void test_async_sync() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test19.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, ASYNC_WRITES * 8);
+	async_state st;
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.cond, NULL);
+	st.completed = 0;
+	st.bytes = 0;
+	for (int i = 0; i < ASYNC_WRITES; i++) {
+		char buf[8];
+		snprintf(buf, sizeof(buf), "rec%04d", i);
+		write_t *wrt = gtfs_write_file(gtfs, fl, i * 8, 8, buf);
+		// mix in a plain sync, which may end up leading queued asynchronous ones
+		if (i % 8 == 7) {
+			if (gtfs_sync_write_file(wrt) == 8) async_done(&st, 8);
+		} else {
+			gtfs_sync_write_file_async(wrt, async_done, &st);
+		}
+	}
+	pthread_mutex_lock(&st.lock);
+	while (st.completed < ASYNC_WRITES) pthread_cond_wait(&st.cond, &st.lock);
+	pthread_mutex_unlock(&st.lock);
+	gtfs_close_file(gtfs, fl);
+
+	cout.flush();
+	int pid = fork();
+	if (pid == 0) {
+		gtfs_t *gtfs2 = gtfs_init(directory, verbose);
+		file_t *fl2 = gtfs_open_file(gtfs2, filename, ASYNC_WRITES * 8);
+		bool ok = st.bytes == ASYNC_WRITES * 8;
+		for (int i = 0; i < ASYNC_WRITES && ok; i++) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "rec%04d", i);
+			char *data = gtfs_read_file(gtfs2, fl2, i * 8, 8);
+			ok = memcmp(data, buf, 8) == 0;
+		}
+		ok ? cout << PASS : cout << FAIL;
+		gtfs_close_file(gtfs2, fl2);
+		exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+// **Test 20**: Testing that operations show up in the stats and in their periodic dump.
+
+void test_stats() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string dump = directory + "/test20.stats";
+	remove(dump.c_str());
+	gtfs_set_stats_dump(gtfs, dump, 20);
+	string filename = "test20.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, 100);
+	for (int i = 0; i < 5; i++) gtfs_sync_write_file(gtfs_write_file(gtfs, fl, i * 10, 10, "0123456789"));
+	gtfs_abort_write_file(gtfs_write_file(gtfs, fl, 0, 4, "oops"));
+	char buf[10];
+	gtfs_read_file_into(gtfs, fl, 0, 10, buf);
+	gtfs_close_file(gtfs, fl);
+	gtfs_stats_t st = gtfs_get_stats(gtfs);
+	bool ok = st.ops[GTFS_OP_OPEN].count == 1 && st.ops[GTFS_OP_WRITE].count == 6 && st.ops[GTFS_OP_SYNC].count == 5;
+	ok = ok && st.ops[GTFS_OP_ABORT].count == 1 && st.ops[GTFS_OP_READ].count == 1;
+	uint64_t in_buckets = 0;
+	for (int b = 0; b < GTFS_STATS_BUCKETS; b++) in_buckets += st.ops[GTFS_OP_SYNC].buckets[b];
+	ok = ok && in_buckets == 5 && st.ops[GTFS_OP_SYNC].max_ns > 0;
+	ok = ok && st.log_records == 5 && st.log_bytes >= 50 && st.fsyncs >= 1 && st.lock_waits >= 1;
+	usleep(100000);
+	gtfs_set_stats_dump(gtfs, dump, 0);
+	char line[4096];
+	int fd = open(dump.c_str(), O_RDONLY);
+	int n = fd == -1 ? 0 : read(fd, line, sizeof(line) - 1);
+	if (fd != -1) close(fd);
+	line[n > 0 ? n : 0] = '\0';
+	ok = ok && strstr(line, "\"sync\":{\"count\":5") != NULL;
+	ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 21**: Testing that writes past the undo spill threshold keep their undo record on disk and abort correctly.
+void test_undo_spill() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	gtfs->undo_spill_threshold = 4096;
+	string filename = "test21.txt";
+	int length = 64 * 1024;
+	file_t *fl = gtfs_open_file(gtfs, filename, length);
+	string before(length, 'o'), after(length, 'n');
+	gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, length, before.c_str()));
+	write_t *wrt = gtfs_write_file(gtfs, fl, 0, length, after.c_str());
+	bool ok = wrt->old_data == NULL && wrt->undo_fd != -1;
+	char *data = gtfs_read_file(gtfs, fl, 0, length);
+	ok = ok && string(data, length) == after;
+	delete[] data;
+	gtfs_abort_write_file(wrt);
+	data = gtfs_read_file(gtfs, fl, 0, length);
+	ok = ok && string(data, length) == before;
+	delete[] data;
+	// a small write still keeps its undo record in memory
+	wrt = gtfs_write_file(gtfs, fl, 100, 5, "small");
+	ok = ok && wrt->old_data != NULL && wrt->undo_fd == -1;
+	gtfs_abort_write_file(wrt);
+	wrt = gtfs_write_file(gtfs, fl, 0, length, after.c_str());
+	ok = ok && gtfs_sync_write_file(wrt) == length;
+	gtfs_close_file(gtfs, fl);
+	fl = gtfs_open_file(gtfs, filename, length);
+	data = gtfs_read_file(gtfs, fl, 0, length);
+	ok = ok && string(data, length) == after;
+	delete[] data;
+	gtfs_close_file(gtfs, fl);
+	ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 22**: Testing that compressed log records replay into files, memory maps, checkpoints and a rebuilt index.
+void test_log_compression() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	gtfs->log_compress_threshold = 256;
+	string filename = "test22.txt";
+	int length = 8 * 4096;
+	file_t *fl = gtfs_open_file(gtfs, filename, length);
+	// zeros with a few words, repeated text, data that does not compress, and
+	// a small write under the threshold
+	string sparse(length, '\0'), text, noise(3000, ' ');
+	sparse.replace(5000, 5, "hello");
+	sparse.replace(20000, 5, "world");
+	while ((int) text.size() < 10000) text += "the quick brown fox jumps over the lazy dog ";
+	text.resize(10000);
+	for (size_t i = 0; i < noise.size(); i++) noise[i] = rand() % 256;
+	gtfs_stats_t before = gtfs_get_stats(gtfs);
+	gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, length, sparse.c_str()));
+	gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 1000, text.size(), text.c_str()));
+	gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 15000, noise.size(), noise.c_str()));
+	gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 4095, 6, "across"));
+	gtfs_stats_t after = gtfs_get_stats(gtfs);
+	char *data = gtfs_read_file(gtfs, fl, 0, length);
+	string expected(data, length);
+	delete[] data;
+	gtfs_close_file(gtfs, fl);
+	uint64_t logged = after.log_bytes - before.log_bytes;
+	bool ok = logged < (uint64_t) (length + text.size()) / 4 + noise.size() + 1024;
+
+	// replay in both data modes, then from the files after a checkpoint
+	int modes[] = { GTFS_DATA_COPY, GTFS_DATA_MMAP };
+	for (int m = 0; m < 2; m++) {
+		gtfs_t *g = gtfs_init(directory, verbose, modes[m]);
+		fl = gtfs_open_file(g, filename, length);
+		data = gtfs_read_file(g, fl, 0, length);
+		ok = ok && string(data, length) == expected;
+		delete[] data;
+		gtfs_close_file(g, fl);
+	}
+	remove((directory + "/log.idx").c_str());
+	cout.flush();
+	int pid = fork();
+	if (pid == 0) {
+		gtfs_t *g = gtfs_init(directory, verbose);
+		file_t *f = gtfs_open_file(g, filename, length);
+		char *d = gtfs_read_file(g, f, 0, length);
+		bool same = string(d, length) == expected;
+		gtfs_close_file(g, f);
+		exit(same ? 0 : 1);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+	gtfs_clean(gtfs);
+	int fd = open((directory + "/" + filename).c_str(), O_RDONLY);
+	string content(length, 'x');
+	ok = ok && pread(fd, &content[0], length, 0) == length && content == expected;
+	close(fd);
+	ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 23**: Testing that processes opening a file share its replayed image and replay only newer records.
+
+// open filename in a new process with the file cache on, and report how many
+// log records it replayed, or -1 if the content is not expected
+int cached_open(const string& filename, const string& expected) {
+	int p[2];
+	if (pipe(p) == -1) return -1;
+	cout.flush();
+	int pid = fork();
+	if (pid == 0) {
+		gtfs_t *gtfs = gtfs_init(directory, verbose);
+		gtfs->file_cache = 1;
+		file_t *fl = gtfs_open_file(gtfs, filename, expected.size());
+		char *data = gtfs_read_file(gtfs, fl, 0, expected.size());
+		int replayed = string(data, expected.size()) == expected ? (int) gtfs_get_stats(gtfs).replay_records : -1;
+		gtfs_close_file(gtfs, fl);
+		write(p[1], &replayed, sizeof(replayed));
+		exit(0);
+	}
+	close(p[1]);
+	int replayed = -1;
+	if (read(p[0], &replayed, sizeof(replayed)) != sizeof(replayed)) replayed = -1;
+	close(p[0]);
+	waitpid(pid, NULL, 0);
+	return replayed;
+}
+
+void test_file_cache() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test23.txt";
+	string expected(1000, '\0');
+	file_t *fl = gtfs_open_file(gtfs, filename, expected.size());
+	for (int i = 0; i < 10; i++) {
+		string str = "record " + to_string(i);
+		gtfs_sync_write_file(gtfs_write_file(gtfs, fl, i * 50, str.size(), str.c_str()));
+		expected.replace(i * 50, str.size(), str);
+	}
+	// the first open replays the whole log, the next ones attach the image
+	bool ok = cached_open(filename, expected) == 10;
+	ok = ok && cached_open(filename, expected) == 0;
+	gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 600, 5, "fresh"));
+	expected.replace(600, 5, "fresh");
+	ok = ok && cached_open(filename, expected) == 1;
+	// a checkpoint leaves the image valid
+	gtfs_clean(gtfs);
+	ok = ok && cached_open(filename, expected) == 0;
+	// an unsynced write stays private to its process
+	write_t *wrt = gtfs_write_file(gtfs, fl, 700, 7, "private");
+	ok = ok && cached_open(filename, expected) == 0;
+	gtfs_abort_write_file(wrt);
+	// a removed file comes back empty, not with the old image
+	gtfs_close_file(gtfs, fl);
+	gtfs_remove_file(gtfs, fl);
+	fl = gtfs_open_file(gtfs, filename, expected.size());
+	gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 3, "new"));
+	expected.assign(expected.size(), '\0');
+	expected.replace(0, 3, "new");
+	ok = ok && cached_open(filename, expected) == 1;
+	gtfs_close_file(gtfs, fl);
+	gtfs_remove_file(gtfs, fl);
+	// the segment under the key of a file may be another file's, since ftok()
+	// keeps only part of its inode number: it is bypassed and left alone
+	string other = "test23b.txt";
+	fl = gtfs_open_file(gtfs, other, 100);
+	gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 5, "bytes"));
+	gtfs_close_file(gtfs, fl);
+	int shm_id = shmget(ftok((directory + "/" + other).c_str(), 3), 1 << 16, 0666 | IPC_CREAT);
+	char *foreign = (char*) shmat(shm_id, NULL, 0);
+	memset(foreign, 'Z', 1 << 16);
+	string expected2(100, '\0');
+	expected2.replace(0, 5, "bytes");
+	ok = ok && cached_open(other, expected2) == 1;
+	gtfs_remove_file(gtfs, fl);
+	ok = ok && string(foreign, 1 << 16) == string(1 << 16, 'Z');
+	shmdt(foreign);
+	shmctl(shm_id, IPC_RMID, NULL);
+	ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 24**: Testing that writes past the end grow a file, and that it keeps its length on reopen, also past 2GB (in copy mode with ./test verbose_flag big).
+
+void test_file_growth() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test24.txt";
+	file_t *fl = gtfs_open_file(gtfs, filename, 100);
+	string str = "Past the end.";
+	bool ok = gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 5000, str.size(), str.c_str())) == (ssize_t) str.size();
+	ok = ok && fl->file_length == 5000 + (off_t) str.size();
+	char *data = gtfs_read_file(gtfs, fl, 4990, 10 + str.size());
+	ok = ok && string(data, 10) == string(10, '\0') && memcmp(data + 10, str.c_str(), str.size()) == 0;
+	delete[] data;
+	gtfs_close_file(gtfs, fl);
+	// the grown length comes from the log record, then from the file itself
+	for (int round = 0; round < 2; round++) {
+		fl = gtfs_open_file(gtfs, filename, 100);
+		ok = ok && fl != NULL && fl->file_length == 5000 + (off_t) str.size();
+		char buf[32];
+		ok = ok && gtfs_read_file_into(gtfs, fl, 5000, str.size(), buf) == (ssize_t) str.size() && memcmp(buf, str.c_str(), str.size()) == 0;
+		gtfs_close_file(gtfs, fl);
+		gtfs_clean(gtfs);
+	}
+	gtfs_remove_file(gtfs, fl);
+
+	// a sparse mmap-backed file with data beyond 32-bit offsets
+	gtfs_t *gtfs2 = gtfs_init(directory, verbose, GTFS_DATA_MMAP);
+	off_t far = (3LL << 30) + 7;
+	fl = gtfs_open_file(gtfs2, filename, 4096);
+	ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs2, fl, far, str.size(), str.c_str())) == (ssize_t) str.size();
+	gtfs_close_file(gtfs2, fl);
+	gtfs_clean(gtfs2);
+	fl = gtfs_open_file(gtfs2, filename, 4096);
+	char buf[32];
+	ok = ok && fl->file_length == far + (off_t) str.size();
+	ok = ok && gtfs_read_file_into(gtfs2, fl, far, str.size(), buf) == (ssize_t) str.size() && memcmp(buf, str.c_str(), str.size()) == 0;
+	gtfs_close_file(gtfs2, fl);
+	gtfs_remove_file(gtfs2, fl);
+
+	// an aborted write gives back what it grew, also on disk in mmap mode
+	fl = gtfs_open_file(gtfs2, filename, 4096);
+	gtfs_abort_write_file(gtfs_write_file(gtfs2, fl, 10000, str.size(), str.c_str()));
+	struct stat statbuf;
+	ok = ok && fl->file_length == 4096 && stat((directory + "/" + filename).c_str(), &statbuf) == 0 && statbuf.st_size == 4096;
+	write_t *wrt = gtfs_write_file(gtfs2, fl, 9000, str.size(), str.c_str());
+	ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs2, fl, 5000, str.size(), str.c_str())) == (ssize_t) str.size();
+	gtfs_abort_write_file(wrt);
+	ok = ok && fl->file_length == 5000 + (off_t) str.size();
+	gtfs_close_file(gtfs2, fl);
+	gtfs_remove_file(gtfs2, fl);
+
+	// a copy-mode file is read in full, although one read() stops short of 2.3GB;
+	// it is held in memory twice, so only on request
+	if (big_files) {
+		off_t big = 2200LL << 20;
+		fl = gtfs_open_file(gtfs, filename, big + 100LL * (1 << 20));
+		ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, big, 1, "Q")) == 1;
+		gtfs_close_file(gtfs, fl);
+		gtfs_clean(gtfs);
+		fl = gtfs_open_file(gtfs, filename, 4096);
+		ok = ok && fl->file_length == big + 100LL * (1 << 20) && gtfs_read_file_into(gtfs, fl, big, 1, buf) == 1 && buf[0] == 'Q';
+		gtfs_close_file(gtfs, fl);
+		gtfs_remove_file(gtfs, fl);
+	}
+	ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 25**: Testing that vectored writes sync as one record, abort every range, and read back with vectored reads.
+
+void test_vectored() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	string filename = "test25.txt";
+	string expected(4096, '\0');
+	file_t *fl = gtfs_open_file(gtfs, filename, expected.size());
+	// scattered 64-byte slots, the last one overlapping the first
+	vector<string> slots;
+	vector<gtfs_iovec_t> iov;
+	for (int i = 0; i < 16; i++) slots.push_back(string(64, 'a' + i));
+	for (int i = 0; i < 16; i++) {
+		gtfs_iovec_t v = { (i * 37 % 16) * 256, 64, &slots[i][0] };
+		if (i == 15) v.offset = iov[0].offset + 32;
+		iov.push_back(v);
+		expected.replace(v.offset, 64, slots[i]);
+	}
+	uint64_t syncs = gtfs_get_stats(gtfs).log_records;
+	write_t *wrt = gtfs_writev_file(gtfs, fl, &iov[0], iov.size());
+	bool ok = gtfs_sync_write_file(wrt) == 16 * 64;
+	ok = ok && gtfs_get_stats(gtfs).log_records == syncs + 1;
+	// an aborted vectored write, spilled, leaves nothing behind
+	gtfs->undo_spill_threshold = 128;
+	string other(64, 'Z');
+	gtfs_iovec_t bad[3] = { { 0, 64, &other[0] }, { 8, 64, &other[0] }, { 4000, 64, &other[0] } };
+	gtfs_abort_write_file(gtfs_writev_file(gtfs, fl, bad, 3));
+	char *data = gtfs_read_file(gtfs, fl, 0, expected.size());
+	ok = ok && fl->file_length == 4096 && string(data, expected.size()) == expected;
+	delete[] data;
+	gtfs_close_file(gtfs, fl);
+	// replayed from the log, then from the file after a checkpoint
+	for (int round = 0; round < 2; round++) {
+		gtfs_t *gtfs2 = gtfs_init(directory, verbose);
+		fl = gtfs_open_file(gtfs2, filename, expected.size());
+		vector<string> bufs(16, string(64, '\0'));
+		vector<gtfs_iovec_t> riov;
+		for (int i = 0; i < 16; i++) {
+			gtfs_iovec_t v = { i * 256, 64, &bufs[i][0] };
+			riov.push_back(v);
+		}
+		ok = ok && gtfs_readv_file(gtfs2, fl, &riov[0], riov.size()) == 16 * 64;
+		for (int i = 0; i < 16; i++) ok = ok && bufs[i] == expected.substr(i * 256, 64);
+		gtfs_close_file(gtfs2, fl);
+		gtfs_clean(gtfs2);
+	}
+	gtfs_remove_file(gtfs, fl);
+	ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 26**: Testing that recovery scans and checkpoints on several threads give the files their records in log order.
+
+#define PAR_FILES 32
+#define PAR_RECORDS 5000 // more than one scan batch
+
+// whether every file of the directory opens with its expected content
+bool par_check(gtfs_t *gtfs, vector<string>& expected) {
+	bool ok = true;
+	for (int f = 0; f < PAR_FILES; f++) {
+		file_t *fl = gtfs_open_file(gtfs, "par" + to_string(f), expected[f].size());
+		char *data = gtfs_read_file(gtfs, fl, 0, expected[f].size());
+		ok = ok && string(data, expected[f].size()) == expected[f];
+		delete[] data;
+		gtfs_close_file(gtfs, fl);
+	}
+	return ok;
+}
+
+void test_parallel_recovery() {
+	string subdir = directory + "/parallel";
+	mkdir(subdir.c_str(), S_IRWXU);
+	gtfs_t *gtfs = gtfs_init(subdir, verbose, GTFS_DATA_COPY, 8);
+	vector<string> expected(PAR_FILES, string(4096, '\0'));
+	vector<file_t*> fls;
+	for (int f = 0; f < PAR_FILES; f++) fls.push_back(gtfs_open_file(gtfs, "par" + to_string(f), 4096));
+	async_state st;
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.cond, NULL);
+	st.completed = 0;
+	st.bytes = 0;
+	// overlapping writes, so that only replaying them in order gives the expected content
+	for (int i = 0; i < PAR_RECORDS; i++) {
+		int f = i % PAR_FILES, offset = (i * 40) % 4000;
+		string str(64, 'a' + i % 26);
+		expected[f].replace(offset, 64, str);
+		gtfs_sync_write_file_async(gtfs_write_file(gtfs, fls[f], offset, 64, str.c_str()), async_done, &st);
+	}
+	pthread_mutex_lock(&st.lock);
+	while (st.completed < PAR_RECORDS) pthread_cond_wait(&st.cond, &st.lock);
+	pthread_mutex_unlock(&st.lock);
+	for (int f = 0; f < PAR_FILES; f++) gtfs_close_file(gtfs, fls[f]);
+
+	// rebuild the index from the log, then checkpoint it
+	remove((subdir + "/log.idx").c_str());
+	cout.flush();
+	int pid = fork();
+	if (pid == 0) {
+		gtfs_t *gtfs2 = gtfs_init(subdir, verbose, GTFS_DATA_COPY, 8);
+		bool ok = gtfs_get_stats(gtfs2).scanned_records == PAR_RECORDS && par_check(gtfs2, expected);
+		gtfs_clean(gtfs2);
+		ok = ok && par_check(gtfs2, expected);
+		// a corrupt record ends the scan, even if records after it are verified first
+		file_t *fl = gtfs_open_file(gtfs2, "par0", 4096);
+		gtfs_sync_write_file(gtfs_write_file(gtfs2, fl, 0, 12, "corrupt this"));
+		gtfs_sync_write_file(gtfs_write_file(gtfs2, fl, 100, 12, "lost with it"));
+		gtfs_close_file(gtfs2, fl);
+		string segment = subdir + "/log.00000000";
+		int fd = open(segment.c_str(), O_RDWR);
+		struct stat statbuf;
+		fstat(fd, &statbuf);
+		string log(statbuf.st_size, '\0');
+		pread(fd, &log[0], log.size(), 0);
+		size_t at = log.find("corrupt this");
+		ok = ok && at != string::npos;
+		pwrite(fd, "C", 1, at);
+		close(fd);
+		remove((subdir + "/log.idx").c_str());
+		gtfs_t *gtfs3 = gtfs_init(subdir, verbose, GTFS_DATA_COPY, 8);
+		ok = ok && par_check(gtfs3, expected);
+		ok ? cout << PASS : cout << FAIL;
+		exit(0);
+	}
+	waitpid(pid, NULL, 0);
+}
+
+// **Test 27**: Testing that files are extended and preallocated in place, and that checkpoints reuse their descriptors until the file is removed, however many files they write to.
+
+// the content of a file on disk
+string disk_read(string path, size_t length) {
+	string data(length, '\0');
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1 || pread(fd, &data[0], length, 0) != (ssize_t) length) data.clear();
+	if (fd != -1) close(fd);
+	return data;
+}
+
+void test_file_extend() {
+	gtfs_t *gtfs = gtfs_init(directory, verbose);
+	gtfs->file_prealloc = 1;
+	string filename = "test27.txt", path = directory + "/" + filename;
+	size_t length = 1 << 20;
+	// preallocation falls back to a sparse file where fallocate() is not supported
+	int probe = open(path.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	bool prealloc = fallocate(probe, 0, 0, 4096) == 0;
+	close(probe);
+	remove(path.c_str());
+	file_t *fl = gtfs_open_file(gtfs, filename, length);
+	struct stat statbuf;
+	bool ok = stat(path.c_str(), &statbuf) == 0 && statbuf.st_size == (off_t) length;
+	if (prealloc) ok = ok && statbuf.st_blocks * 512 >= (off_t) length;
+	// a shorter open keeps the length
+	gtfs_close_file(gtfs, fl);
+	fl = gtfs_open_file(gtfs, filename, 100);
+	ok = ok && fl->file_length == (off_t) length;
+	string expected(length, '\0');
+	for (int round = 0; round < 2; round++) {
+		string str(128, 'p' + round);
+		expected.replace(round * 4096, 128, str);
+		gtfs_sync_write_file(gtfs_write_file(gtfs, fl, round * 4096, 128, str.c_str()));
+		gtfs_clean(gtfs);
+		ok = ok && gtfs->file_fds.size() == 1 && disk_read(path, length) == expected;
+	}
+	int fd = gtfs->file_fds[filename].fd;
+	gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 8192, 5, "again"));
+	gtfs_clean(gtfs);
+	ok = ok && gtfs->file_fds[filename].fd == fd;
+	// the file created after a remove is written to, not the removed one
+	gtfs_close_file(gtfs, fl);
+	gtfs_remove_file(gtfs, fl);
+	fl = gtfs_open_file(gtfs, filename, 4096);
+	gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 5, "fresh"));
+	gtfs_clean(gtfs);
+	ok = ok && disk_read(path, 5) == "fresh";
+	gtfs_close_file(gtfs, fl);
+	gtfs_remove_file(gtfs, fl);
+	// a checkpoint of more files than the cache holds writes to every one of them
+	vector<file_t*> fls;
+	for (int f = 0; f < FILE_FD_CACHE_MAX + 100; f++) {
+		fls.push_back(gtfs_open_file(gtfs, "fd" + to_string(f), 64));
+		gtfs_sync_write_file(gtfs_write_file(gtfs, fls[f], 0, 8, ("fd" + to_string(100000 + f)).c_str()));
+		gtfs_close_file(gtfs, fls[f]);
+	}
+	ok = ok && gtfs_clean(gtfs) == 0 && gtfs->file_fds.size() <= FILE_FD_CACHE_MAX;
+	for (int f = 0; f < FILE_FD_CACHE_MAX + 100; f++) {
+		ok = ok && disk_read(directory + "/fd" + to_string(f), 8) == ("fd" + to_string(100000 + f)).substr(0, 8);
+		gtfs_remove_file(gtfs, fls[f]);
+	}
+	ok ? cout << PASS : cout << FAIL;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2)
-      printf("Usage: ./test verbose_flag\n");
+      printf("Usage: ./test verbose_flag [big]\n");
     else
       verbose = strtol(argv[1], NULL, 10);
+    big_files = argc >= 3 && string(argv[2]) == "big";
 	
 	// Get current directory path
 	char cwd[256];
@@ -164,4 +1354,96 @@ int main(int argc, char **argv) {
 	cout << "================== Test 4 ==================\n";
 	cout << "Testing that logs of deleted file are invalidated.\n";
 	test_remove_file();
-}
\ No newline at end of file
+
+	cout << "================== Test 5 ==================\n";
+	cout << "Testing that concurrent syncs are all persisted by group commit.\n";
+	test_group_commit();
+
+	cout << "================== Test 6 ==================\n";
+	cout << "Testing that a missing log index is rebuilt from the log.\n";
+	test_log_index();
+
+	cout << "================== Test 7 ==================\n";
+	cout << "Testing that a memory-mapped file sees synced log records and aborts correctly.\n";
+	test_mmap_file();
+
+	cout << "================== Test 8 ==================\n";
+	cout << "Testing that views and caller-buffer reads return the file contents.\n";
+	test_read_view();
+
+	cout << "================== Test 9 ==================\n";
+	cout << "Testing that a background checkpoint applies overlapping writes in order.\n";
+	test_checkpoint();
+
+	cout << "================== Test 10 ==================\n";
+	cout << "Testing that a torn record at the end of the log is detected and dropped.\n";
+	test_torn_record();
+
+	cout << "================== Test 11 ==================\n";
+	cout << "Testing that a log in the original record format is migrated.\n";
+	test_log_migration();
+
+	cout << "================== Test 12 ==================\n";
+	cout << "Testing that one gtfs_t and its files can be used by many threads at once.\n";
+	test_multithreaded();
+
+	cout << "================== Test 13 ==================\n";
+	cout << "Testing that processes appending to one log at once all persist their records, and that records of killed appenders never show up later.\n";
+	test_multiprocess_append();
+
+	cout << "================== Test 14 ==================\n";
+	cout << "Testing that a transaction commits writes to several files as one record, and rolls back.\n";
+	test_transaction();
+
+	cout << "================== Test 15 ==================\n";
+	cout << "Testing that recycled write descriptors and buffers keep writes of every size intact.\n";
+	test_pooled_writes();
+
+	cout << "================== Test 16 ==================\n";
+	cout << "Testing that a removed file's records stay void after the log index is rebuilt and a checkpoint, also when the file was left behind.\n";
+	test_remove_tombstone();
+
+	cout << "================== Test 17 ==================\n";
+	cout << "Testing that background compaction deletes checkpointed log segments while writes go on.\n";
+	test_log_segments();
+
+	cout << "================== Test 18 ==================\n";
+	cout << "Testing that flushing a file writes only the bytes of its synced writes, and never writes that failed to sync.\n";
+	test_flush_dirty_pages();
+
+	cout << "================== Test 19 ==================\n";
+	cout << "Testing that asynchronous syncs call back once their records are durable.\n";
+	test_async_sync();
+
+	cout << "================== Test 20 ==================\n";
+	cout << "Testing that operations show up in the stats and in their periodic dump.\n";
+	test_stats();
+
+	cout << "================== Test 21 ==================\n";
+	cout << "Testing that writes past the undo spill threshold keep their undo record on disk and abort correctly.\n";
+	test_undo_spill();
+
+	cout << "================== Test 22 ==================\n";
+	cout << "Testing that compressed log records replay into files, memory maps, checkpoints and a rebuilt index.\n";
+	test_log_compression();
+
+	cout << "================== Test 23 ==================\n";
+	cout << "Testing that processes opening a file share its replayed image and replay only newer records.\n";
+	test_file_cache();
+
+	cout << "================== Test 24 ==================\n";
+	cout << "Testing that writes past the end grow a file, and that it keeps its length on reopen, also past 2GB (in copy mode with ./test verbose_flag big).\n";
+	test_file_growth();
+
+	cout << "================== Test 25 ==================\n";
+	cout << "Testing that vectored writes sync as one record, abort every range, and read back with vectored reads.\n";
+	test_vectored();
+
+	cout << "================== Test 26 ==================\n";
+	cout << "Testing that recovery scans and checkpoints on several threads give the files their records in log order.\n";
+	test_parallel_recovery();
+
+	cout << "================== Test 27 ==================\n";
+	cout << "Testing that files are extended and preallocated in place, and that checkpoints reuse their descriptors until the file is removed, however many files they write to.\n";
+	test_file_extend();
+}